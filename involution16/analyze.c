@@ -0,0 +1,360 @@
+#include "analyze.h"
+
+#include "involution16.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+const char *kIssueStrings[] = {
+  [kIssueAliasedRegs] = "destination register is also a source",
+  [kIssueInvalidSrr] = "invalid srr encoding",
+  [kIssueMisalignedJump] = "jump address not aligned to 2 bytes",
+  [kIssueMismatchedJump] = "jump instruction is not equal to its target",
+  [kIssueUnpairedJump] = "jump has no matching jump to land on",
+};
+
+// slot and group flags
+enum {
+  // the state has been set
+  kFlagReached = 1 << 0,
+  // in the work list
+  kFlagQueued = 1 << 1,
+  // the instruction has been checked for issues that depend only on itself
+  kFlagChecked = 1 << 2,
+  // a jump issue has been reported for the slot
+  kFlagJumpReported = 1 << 3,
+  // the group's slots have been given their place in group_slots
+  kFlagCollected = 1 << 4,
+};
+
+struct Analyzer *AnalyzerCreate(void) {
+  struct Analyzer *a = calloc(1, sizeof(*a));
+  Assume(a);
+  return a;
+}
+
+void AnalyzerDestroy(struct Analyzer *a) {
+  free(a->issues);
+  free(a);
+}
+
+static uint8_t Byte(const struct Analyzer *a, uint16_t addr) {
+  return addr < a->rom_len ? a->rom[addr] : 0xFF;
+}
+
+static uint8_t *SlotFlags(struct Analyzer *a, uint32_t slot) {
+  if (a->slot_gen[slot] != a->gen) {
+    a->slot_gen[slot] = a->gen;
+    a->slot_flags[slot] = 0;
+  }
+  return &a->slot_flags[slot];
+}
+
+static void Report(struct Analyzer *a, uint16_t addr, IssueKind kind,
+    uint16_t target) {
+  if (a->issue_count == a->issue_cap) {
+    a->issue_cap = a->issue_cap ? a->issue_cap * 2 : 16;
+    a->issues = realloc(a->issues, a->issue_cap * sizeof(*a->issues));
+    Assume(a->issues);
+  }
+  a->issues[a->issue_count++] = (struct AnalyzeIssue) {
+    .addr = addr,
+    .kind = kind,
+    .target = target,
+  };
+}
+
+// merges state into cur, returning whether that changed cur. merging only
+// ever forgets registers, which bounds how often anything can be queued
+static bool MergeState(struct AnalyzeState *cur, uint8_t *flags,
+    const struct AnalyzeState *state) {
+  if (!(*flags & kFlagReached)) {
+    *cur = *state;
+    *flags |= kFlagReached;
+    return true;
+  }
+
+  uint16_t known = cur->known & state->known;
+  for (int r = 0; r < 16; r++) {
+    if (known & 1 << r && cur->reg[r] != state->reg[r])
+      known &= ~(1 << r);
+  }
+  if (known == cur->known) return false;
+  cur->known = known;
+  return true;
+}
+
+static void Queue(struct Analyzer *a, uint8_t *flags, uint32_t item) {
+  if (*flags & kFlagQueued) return;
+  *flags |= kFlagQueued;
+  a->work[a->work_len++] = item;
+}
+
+// merges state into what's known on entry to slot
+static void Merge(struct Analyzer *a, uint32_t slot,
+    const struct AnalyzeState *state) {
+  uint8_t *flags = SlotFlags(a, slot);
+  if (MergeState(&a->states[slot], flags, state))
+    Queue(a, flags, slot);
+}
+
+// merges state into what's known after landing on any jeq of the group
+static void MergeGroup(struct Analyzer *a, uint32_t group,
+    const struct AnalyzeState *state) {
+  uint8_t *flags = &a->group_flags[group];
+  if (MergeState(&a->group_states[group], flags, state))
+    Queue(a, flags, kAnalyzeSlots + group);
+}
+
+// reports the issues of the instruction at slot that don't depend on how it
+// was reached, the first time it's reached
+static void Check(struct Analyzer *a, uint32_t slot) {
+  uint8_t *flags = SlotFlags(a, slot);
+  if (*flags & kFlagChecked) return;
+  *flags |= kFlagChecked;
+
+  uint16_t addr = slot * 2;
+  uint8_t op = Byte(a, addr) >> 4, x = Byte(a, addr) & 0xF;
+  uint8_t y = Byte(a, addr + 1) >> 4, z = Byte(a, addr + 1) & 0xF;
+
+  switch (op) {
+    case kOpXri:
+    case kOpBrk:
+      break;
+    case kOpSrr:
+      if (z >= kSrrCodeCount)
+        Report(a, addr, kIssueInvalidSrr, 0);
+      else if (x == y)
+        Report(a, addr, kIssueAliasedRegs, 0);
+      break;
+    case kOpSrm:
+      if (x == y)
+        Report(a, addr, kIssueAliasedRegs, 0);
+      break;
+    default:
+      if (x == y || x == z)
+        Report(a, addr, kIssueAliasedRegs, 0);
+      break;
+  }
+}
+
+static void JumpIssue(struct Analyzer *a, uint32_t slot, IssueKind kind,
+    uint16_t target) {
+  uint8_t *flags = SlotFlags(a, slot);
+  if (*flags & kFlagJumpReported) return;
+  *flags |= kFlagJumpReported;
+  Report(a, slot * 2, kind, target);
+}
+
+// numbers a jeq by its registers
+static uint32_t JeqNumber(const uint8_t bytes[2]) {
+  return (bytes[0] & 0xF) << 8 | bytes[1];
+}
+
+// what an alu op xors into its destination, as ExecuteStep computes it.
+// rotating a 16 bit value within 32 bits and truncating is a shift
+static uint16_t AluResult(uint8_t op, uint16_t y, uint16_t z) {
+  switch (op) {
+    case kOpAdd: return y + z;
+    case kOpSub: return y - z;
+    case kOpRor:
+    case kOpShr: return y >> (z & 0xF);
+    case kOpRol:
+    case kOpShl: return y << (z & 0xF);
+    case kOpAnd: return y & z;
+    case kOpOra: return y | z;
+    case kOpMul: return (unsigned) y * z;
+    case kOpDiv: return z ? y / z : 0;
+    case kOpCmp: return y == z ? 0 : y > z ? 1 : 0xFFFF;
+  }
+  assert(false);
+  return 0;
+}
+
+static bool Known(const struct AnalyzeState *s, uint8_t r) {
+  return s->known & 1 << r;
+}
+
+static void SetReg(struct AnalyzeState *s, uint8_t r, bool known,
+    uint16_t value) {
+  if (known) {
+    s->known |= 1 << r;
+    s->reg[r] = value;
+  } else {
+    s->known &= ~(1 << r);
+  }
+}
+
+// follows the instruction at slot from its entry state to its successors
+static void Follow(struct Analyzer *a, uint32_t slot) {
+  Check(a, slot);
+
+  struct AnalyzeState s = a->states[slot];
+  uint16_t addr = slot * 2;
+  uint8_t bytes[2] = {Byte(a, addr), Byte(a, addr + 1)};
+  uint8_t op = bytes[0] >> 4, x = bytes[0] & 0xF;
+  uint8_t y = bytes[1] >> 4, z = bytes[1] & 0xF;
+  uint32_t next = (slot + 1) % kAnalyzeSlots;
+
+  switch (op) {
+    case kOpXri:
+      s.reg[x] ^= bytes[1];
+      break;
+    case kOpSrr: {
+      if (z >= kSrrCodeCount) return;
+      bool known = Known(&s, x) && Known(&s, y);
+      // bytes numbered as for PermuteRegs, y is written last
+      uint8_t in[4] = {s.reg[x], s.reg[x] >> 8, s.reg[y], s.reg[y] >> 8};
+      const uint8_t *perm = kSrrCodes[z];
+      SetReg(&s, x, known, in[perm[0]] | in[perm[1]] << 8);
+      SetReg(&s, y, known, in[perm[2]] | in[perm[3]] << 8);
+      break;
+    }
+    case kOpSrm:
+      SetReg(&s, x, false, 0);
+      break;
+    case kOpBrk:
+      if (bytes[0] == 0xFF && bytes[1] == 0xFF) return;
+      break;
+    case kOpJeq: {
+      bool always = y == z ||
+        (Known(&s, y) && Known(&s, z) && s.reg[y] == s.reg[z]);
+      bool never = y != z &&
+        Known(&s, y) && Known(&s, z) && s.reg[y] != s.reg[z];
+      if (!always) Merge(a, next, &s);
+      if (never) return;
+
+      // a jump means the registers compared were equal, so one known value
+      // gives away the other
+      struct AnalyzeState jumped = s;
+      if (Known(&s, y) != Known(&s, z)) {
+        uint16_t value = Known(&s, y) ? s.reg[y] : s.reg[z];
+        SetReg(&jumped, y, true, value);
+        SetReg(&jumped, z, true, value);
+      }
+      SetReg(&jumped, x, true, addr);
+
+      // a bad target is only reported if the jump is certain to be taken.
+      // constants alone can't follow the conditions a program uses to steer
+      // clear of its bad jumps, such as a loop counter staying above 0, and
+      // otherwise the paths they rule out would be reported
+      if (Known(&s, x)) {
+        uint16_t target = s.reg[x];
+        if (target & 1) {
+          if (always) JumpIssue(a, slot, kIssueMisalignedJump, target);
+        } else if (Byte(a, target) != bytes[0] ||
+            Byte(a, target + 1) != bytes[1]) {
+          if (always) JumpIssue(a, slot, kIssueMismatchedJump, target);
+        } else {
+          // the jeq landed on isn't executed, but it is on the way back
+          Check(a, target / 2);
+          Merge(a, (target / 2 + 1) % kAnalyzeSlots, &jumped);
+        }
+        return;
+      }
+
+      uint32_t group = JeqNumber(bytes);
+      if (a->group_len[group] < 2)
+        JumpIssue(a, slot, kIssueUnpairedJump, 0);
+      MergeGroup(a, group, &jumped);
+      return;
+    }
+    default: {
+      bool known = Known(&s, x) && Known(&s, y) && Known(&s, z);
+      // dividing by a known 0 leaves the destination alone
+      if (op == kOpDiv && Known(&s, z) && s.reg[z] == 0) break;
+      SetReg(&s, x, known, s.reg[x] ^ AluResult(op, s.reg[y], s.reg[z]));
+      break;
+    }
+  }
+  Merge(a, next, &s);
+}
+
+// lands a jump whose target wasn't known on every copy of the jeq
+static void FollowGroup(struct Analyzer *a, uint32_t group) {
+  const struct AnalyzeState *s = &a->group_states[group];
+  const uint16_t *slots = &a->group_slots[a->group_start[group]];
+  for (uint32_t i = 0; i < a->group_len[group]; i++) {
+    uint32_t slot = slots[i];
+    Check(a, slot);
+    Merge(a, (slot + 1) % kAnalyzeSlots, s);
+  }
+}
+
+// buckets the jeqs of the rom by their number with a counting sort, only
+// touching the numbers that are in the rom
+static void CollectJeqs(struct Analyzer *a) {
+  size_t slots = (a->rom_len + 1) / 2;
+  for (size_t slot = 0; slot < slots; slot++) {
+    uint8_t bytes[2] = {Byte(a, slot * 2), Byte(a, slot * 2 + 1)};
+    if (bytes[0] >> 4 != kOpJeq) continue;
+    uint32_t group = JeqNumber(bytes);
+    if (a->group_gen[group] != a->gen) {
+      a->group_gen[group] = a->gen;
+      a->group_len[group] = 0;
+      a->group_flags[group] = 0;
+    }
+    a->group_len[group]++;
+  }
+
+  // each group starts where the one before it in the rom ended, and is
+  // filled in from there, counting group_len back up
+  uint16_t next = 0;
+  for (size_t slot = 0; slot < slots; slot++) {
+    uint8_t bytes[2] = {Byte(a, slot * 2), Byte(a, slot * 2 + 1)};
+    if (bytes[0] >> 4 != kOpJeq) continue;
+    uint32_t group = JeqNumber(bytes);
+    if (!(a->group_flags[group] & kFlagCollected)) {
+      a->group_flags[group] |= kFlagCollected;
+      a->group_start[group] = next;
+      next += a->group_len[group];
+      a->group_len[group] = 0;
+    }
+    a->group_slots[a->group_start[group] + a->group_len[group]++] = slot;
+  }
+}
+
+static int CompareIssues(const void *a, const void *b) {
+  const struct AnalyzeIssue *ia = a, *ib = b;
+  if (ia->addr != ib->addr) return ia->addr < ib->addr ? -1 : 1;
+  return ia->kind - ib->kind;
+}
+
+size_t Analyze(struct Analyzer *a, const uint8_t *rom, size_t len) {
+  assert(len <= 65536);
+  a->rom = rom;
+  a->rom_len = len;
+  a->gen++;
+  a->issue_count = 0;
+  a->work_len = 0;
+  CollectJeqs(a);
+
+  // a fresh VM starts at address 0 with every register 0
+  struct AnalyzeState start = {.known = 0xFFFF};
+  Merge(a, 0, &start);
+
+  while (a->work_len > 0) {
+    uint32_t item = a->work[--a->work_len];
+    if (item < kAnalyzeSlots) {
+      a->slot_flags[item] &= ~kFlagQueued;
+      Follow(a, item);
+    } else {
+      a->group_flags[item - kAnalyzeSlots] &= ~kFlagQueued;
+      FollowGroup(a, item - kAnalyzeSlots);
+    }
+  }
+
+  // issues come out in the order the flow reached them
+  qsort(a->issues, a->issue_count, sizeof(*a->issues), CompareIssues);
+  return a->issue_count;
+}
@@ -0,0 +1,105 @@
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// finds instructions in a rom that would make it impossible to run backwards,
+// without running it. the rom is followed from address 0 in the forward
+// direction along a control flow graph built from its jeq pairs, keeping
+// track of which registers hold known values:
+//
+//   - a jeq whose target register is known jumps to that address, which must
+//     hold the same jeq, and carries on after it
+//   - a jeq whose target isn't known could land on any other copy of itself
+//     in the rom, so every copy is a successor
+//   - a jeq whose condition compares a register to itself always jumps, one
+//     comparing two known values jumps or falls through as they decide
+//   - a brk (FFFF) ends the flow, while the breakpoints written as dbg n fall
+//     through to the next instruction
+//
+// memory outside the rom holds brk, as in a fresh VM, and memory written by
+// srm is assumed to hold unknown data rather than code. each instruction is
+// looked at a bounded number of times, at most once per register it can lose
+// track of, so the analysis takes time linear in the length of the rom
+
+enum {
+  // aligned instruction slots in memory
+  kAnalyzeSlots = 65536 / 2,
+  // distinct jeq instructions, one per combination of registers
+  kAnalyzeJeqCount = 16 * 16 * 16,
+};
+
+typedef uint8_t IssueKind;
+enum {
+  // the destination register is also a source, so the instruction destroys
+  // the value it would need to undo itself
+  kIssueAliasedRegs,
+  kIssueInvalidSrr,
+  // a jump that is always taken to a known target, and raises
+  // kErrorMisalignedJump or kErrorMismatchedJump
+  kIssueMisalignedJump,
+  kIssueMismatchedJump,
+  // a jeq with no other copy of itself in the rom to jump to or from
+  kIssueUnpairedJump,
+  kIssueKindCount,
+};
+extern const char *kIssueStrings[];
+
+struct AnalyzeIssue {
+  uint16_t addr;
+  IssueKind kind;
+  // the jump target of kIssueMisalignedJump and kIssueMismatchedJump
+  uint16_t target;
+};
+
+// the registers whose values are known at a point in the program
+struct AnalyzeState {
+  uint16_t known;
+  uint16_t reg[16];
+};
+
+struct Analyzer {
+  // the rom being analyzed, every byte past rom_len reads as 0xFF
+  const uint8_t *rom;
+  size_t rom_len;
+
+  // per slot data is only valid where slot_gen matches gen, so starting a
+  // new run doesn't have to clear it
+  uint32_t gen;
+  uint32_t slot_gen[kAnalyzeSlots];
+  uint8_t slot_flags[kAnalyzeSlots];
+  // the state on entry to each reached slot
+  struct AnalyzeState states[kAnalyzeSlots];
+
+  // the slots of the rom holding each jeq, group_len of them from
+  // group_slots[group_start[i]] for jeq number i, along with the state after
+  // a jump to any of them from a jeq of the same number whose target isn't
+  // known. only valid where group_gen matches gen
+  uint32_t group_gen[kAnalyzeJeqCount];
+  uint16_t group_start[kAnalyzeJeqCount];
+  uint16_t group_len[kAnalyzeJeqCount];
+  uint8_t group_flags[kAnalyzeJeqCount];
+  struct AnalyzeState group_states[kAnalyzeJeqCount];
+  uint16_t group_slots[kAnalyzeSlots];
+
+  // slots, and groups numbered from kAnalyzeSlots, whose state changed since
+  // they were last followed
+  uint32_t work[kAnalyzeSlots + kAnalyzeJeqCount];
+  size_t work_len;
+
+  // sorted by address, at most one of each kind per instruction
+  struct AnalyzeIssue *issues;
+  size_t issue_count, issue_cap;
+};
+
+struct Analyzer *AnalyzerCreate(void);
+void AnalyzerDestroy(struct Analyzer *);
+
+// analyzes the len bytes of rom, which is at most 65536 bytes long, and
+// returns the number of issues found. the issues stay in the analyzer until
+// the next run
+size_t Analyze(struct Analyzer *, const uint8_t *rom, size_t len);
+
+#endif
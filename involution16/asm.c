@@ -0,0 +1,426 @@
+#include "asm.h"
+
+#include "disasm.h"
+#include "involution16.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct Assembler *AssemblerCreate(void) {
+  struct Assembler *as = calloc(1, sizeof(*as));
+  Assume(as);
+  as->label_cap = 256;
+  as->labels = calloc(as->label_cap, sizeof(*as->labels));
+  Assume(as->labels);
+  return as;
+}
+
+void AssemblerDestroy(struct Assembler *as) {
+  free(as->labels);
+  free(as->fixups);
+  free(as);
+}
+
+// the state of one run over a source
+struct Run {
+  struct Assembler *as;
+  // the rest of the current line, which ends at end or a comment
+  const char *p, *end;
+  size_t line;
+  uint8_t *out;
+  size_t out_len;
+};
+
+// records an error at the current line, and returns false to be passed up
+static bool Fail(struct Run *run, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(run->as->err, sizeof(run->as->err), fmt, args);
+  va_end(args);
+  run->as->err_line = run->line;
+  return false;
+}
+
+static void SkipSpace(struct Run *run) {
+  while (run->p < run->end && (*run->p == ' ' || *run->p == '\t' ||
+      *run->p == '\r'))
+    run->p++;
+}
+
+// skips spaces and then c if it's next, returning whether it was
+static bool Accept(struct Run *run, char c) {
+  SkipSpace(run);
+  if (run->p < run->end && *run->p == c) {
+    run->p++;
+    return true;
+  }
+  return false;
+}
+
+static bool IsIdentChar(char c, bool first) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+    c == '.' || (!first && c >= '0' && c <= '9');
+}
+
+// reads a name of letters, digits, '_' and '.' not starting with a digit,
+// returning its length, or 0 if there isn't one
+static size_t Ident(struct Run *run, const char **name) {
+  SkipSpace(run);
+  const char *start = run->p;
+  while (run->p < run->end && IsIdentChar(*run->p, run->p == start))
+    run->p++;
+  *name = start;
+  return run->p - start;
+}
+
+static int DigitValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// reads a number, returning false if there isn't one or it doesn't fit in
+// 16 bits
+static bool Number(struct Run *run, uint32_t *value) {
+  SkipSpace(run);
+  const char *p = run->p;
+  if (p == run->end || *p < '0' || *p > '9') return false;
+
+  unsigned base = 10;
+  size_t suffix = 0;
+  if (run->end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+    base = 16;
+    p += 2;
+  }
+  // 'b' is a hex digit, so binary numbers are all digits here
+  size_t n = 0;
+  while (p + n < run->end && DigitValue(p[n]) >= 0) n++;
+  if (base == 10 && p + n < run->end && (p[n] | 0x20) == 'h') {
+    base = 16;
+    suffix = 1;
+  } else if (base == 10 && n > 2 && p[0] == '0' && (p[1] | 0x20) == 'b') {
+    base = 2;
+    p += 2;
+    n -= 2;
+  }
+  if (n == 0) return false;
+
+  uint32_t v = 0;
+  for (size_t i = 0; i < n; i++) {
+    int digit = DigitValue(p[i]);
+    if (digit >= (int) base) return false;
+    v = v * base + digit;
+    if (v > 0xFFFF) return false;
+  }
+  run->p = p + n + suffix;
+  *value = v;
+  return true;
+}
+
+static uint32_t HashName(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t) name[i]) * 16777619u;
+  return h;
+}
+
+// the slot of the label with the given name in this run, or the empty slot
+// where it would go
+static struct AsmLabel *FindLabel(struct Assembler *as, const char *name,
+    size_t len) {
+  size_t mask = as->label_cap - 1;
+  for (size_t i = HashName(name, len) & mask;; i = (i + 1) & mask) {
+    struct AsmLabel *label = &as->labels[i];
+    if (label->gen != as->gen) return label;
+    if (label->len == len && memcmp(label->name, name, len) == 0)
+      return label;
+  }
+}
+
+static void GrowLabels(struct Assembler *as) {
+  struct AsmLabel *old = as->labels;
+  size_t old_cap = as->label_cap;
+  as->label_cap *= 2;
+  as->labels = calloc(as->label_cap, sizeof(*as->labels));
+  Assume(as->labels);
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].gen == as->gen)
+      *FindLabel(as, old[i].name, old[i].len) = old[i];
+  }
+  free(old);
+}
+
+static bool DefineLabel(struct Run *run, const char *name, size_t len) {
+  struct Assembler *as = run->as;
+  struct AsmLabel *label = FindLabel(as, name, len);
+  if (label->gen == as->gen)
+    return Fail(run, "label %.*s defined twice", (int) len, name);
+  if (run->out_len > 0xFFFF)
+    return Fail(run, "label %.*s is past the end of memory", (int) len, name);
+
+  *label = (struct AsmLabel) {name, len, as->gen, run->out_len};
+  // keep the table at most half full
+  if (++as->label_count * 2 > as->label_cap)
+    GrowLabels(as);
+  return true;
+}
+
+static bool Emit(struct Run *run, uint8_t byte) {
+  if (run->out_len >= 65536)
+    return Fail(run, "program is larger than memory");
+  run->out[run->out_len++] = byte;
+  return true;
+}
+
+static void Put(uint8_t *at, uint16_t value, size_t width) {
+  at[0] = value;
+  if (width == 2) at[1] = value >> 8;
+}
+
+// reads a number or label and emits it in width bytes. labels that aren't
+// defined yet are filled in at the end. value is set to the number, or -1 if
+// it isn't known yet
+static bool Value(struct Run *run, size_t width, int32_t *value) {
+  uint32_t max = width == 1 ? 0xFF : 0xFFFF;
+  uint32_t v;
+  const char *name;
+  size_t len;
+  if (Number(run, &v)) {
+    if (v > max) return Fail(run, "%u doesn't fit in %zu bits", v, width * 8);
+  } else if ((len = Ident(run, &name))) {
+    struct Assembler *as = run->as;
+    struct AsmLabel *label = FindLabel(as, name, len);
+    if (label->gen == as->gen) {
+      v = label->addr;
+      if (v > max)
+        return Fail(run, "%.*s doesn't fit in %zu bits", (int) len, name,
+          width * 8);
+    } else {
+      if (as->fixup_count == as->fixup_cap) {
+        as->fixup_cap = as->fixup_cap ? as->fixup_cap * 2 : 64;
+        as->fixups = realloc(as->fixups, as->fixup_cap * sizeof(*as->fixups));
+        Assume(as->fixups);
+      }
+      as->fixups[as->fixup_count++] = (struct AsmFixup) {
+        name, len, run->out_len, width, run->line
+      };
+      *value = -1;
+      for (size_t i = 0; i < width; i++) {
+        if (!Emit(run, 0)) return false;
+      }
+      return true;
+    }
+  } else {
+    return Fail(run, "expected a number or label");
+  }
+
+  *value = v;
+  if (run->out_len + width > 65536)
+    return Fail(run, "program is larger than memory");
+  Put(run->out + run->out_len, v, width);
+  run->out_len += width;
+  return true;
+}
+
+// reads a register, r0 to rF
+static bool Reg(struct Run *run, uint8_t *reg) {
+  const char *name;
+  size_t len = Ident(run, &name);
+  int digit = len == 2 && (name[0] | 0x20) == 'r' ? DigitValue(name[1]) : -1;
+  if (digit < 0)
+    return Fail(run, "expected a register");
+  *reg = digit;
+  return true;
+}
+
+static bool Comma(struct Run *run) {
+  return Accept(run, ',') || Fail(run, "expected ','");
+}
+
+// reads an srr permutation such as p.cdab, as named in fasm/involution16.inc
+static bool Perm(struct Run *run, uint8_t *code) {
+  const char *name;
+  size_t len = Ident(run, &name);
+  if (len == 6 && (name[0] == 'p' || name[0] == 'P') && name[1] == '.') {
+    for (uint8_t c = 0; c < kSrrCodeCount; c++) {
+      bool match = true;
+      for (size_t i = 0; i < 4; i++) {
+        char letter = name[2 + i] | 0x20;
+        match &= letter == 'a' + kSrrCodes[c][i];
+      }
+      if (match) {
+        *code = c;
+        return true;
+      }
+    }
+  }
+  return Fail(run, "expected a permutation");
+}
+
+static bool Insn(struct Run *run, uint8_t op, uint8_t x, uint8_t y,
+    uint8_t z) {
+  return Emit(run, op << 4 | x) && Emit(run, y << 4 | z);
+}
+
+// assembles the instruction or directive named by mnemonic
+static bool Statement(struct Run *run, const char *mnemonic, size_t len) {
+  uint8_t x, y, z;
+  int32_t value;
+
+  uint8_t op = 0;
+  while (op < 16 && !(strlen(kOpNames[op]) == len &&
+      strncasecmp(kOpNames[op], mnemonic, len) == 0))
+    op++;
+
+  switch (op) {
+    case kOpAdd:
+    case kOpSub:
+    case kOpRor:
+    case kOpRol:
+    case kOpShr:
+    case kOpShl:
+    case kOpAnd:
+    case kOpOra:
+    case kOpMul:
+    case kOpDiv:
+    case kOpCmp:
+    case kOpJeq:
+      return Reg(run, &x) && Comma(run) && Reg(run, &y) && Comma(run) &&
+        Reg(run, &z) && Insn(run, op, x, y, z);
+    case kOpXri: {
+      if (!Reg(run, &x) || !Comma(run) || !Emit(run, kOpXri << 4 | x) ||
+          !Value(run, 1, &value))
+        return false;
+      // the value in brackets that disasm.c prints
+      if (Accept(run, '(')) {
+        uint32_t check;
+        if (!Number(run, &check) || !Accept(run, ')'))
+          return Fail(run, "expected a number in brackets");
+        if (value >= 0 && check != (uint32_t) value)
+          return Fail(run, "%u in brackets doesn't match %d", check, value);
+      }
+      return true;
+    }
+    case kOpSrr:
+      return Reg(run, &x) && Comma(run) && Reg(run, &y) && Comma(run) &&
+        Perm(run, &z) && Insn(run, op, x, y, z);
+    case kOpSrm:
+      return Reg(run, &x) && Comma(run) && Reg(run, &y) &&
+        Insn(run, op, x, y, 0);
+    case kOpBrk:
+      return Insn(run, op, 0xF, 0xF, 0xF);
+  }
+
+  if (len == 3 && strncasecmp(mnemonic, "dbg", 3) == 0) {
+    uint32_t n;
+    if (!Number(run, &n) || n > 0xF)
+      return Fail(run, "expected a number from 0 to 15");
+    return Insn(run, kOpBrk, n, 0xF, n);
+  }
+
+  if (len == 2 && (strncasecmp(mnemonic, "db", 2) == 0 ||
+      strncasecmp(mnemonic, "dw", 2) == 0)) {
+    size_t width = (mnemonic[1] | 0x20) == 'w' ? 2 : 1;
+    do {
+      if (!Value(run, width, &value)) return false;
+    } while (Accept(run, ','));
+    return true;
+  }
+
+  if (len == 7 && strncmp(mnemonic, "include", 7) == 0) {
+    static const char kIsaInclude[] = "\"involution16.inc\"";
+    SkipSpace(run);
+    size_t rest = run->end - run->p;
+    while (rest && (run->p[rest - 1] == ' ' || run->p[rest - 1] == '\t' ||
+        run->p[rest - 1] == '\r'))
+      rest--;
+    if (rest != strlen(kIsaInclude) || memcmp(run->p, kIsaInclude, rest) != 0)
+      return Fail(run, "only involution16.inc can be included");
+    run->p += rest;
+    return true;
+  }
+
+  return Fail(run, "unknown instruction %.*s", (int) len, mnemonic);
+}
+
+static bool Line(struct Run *run) {
+  const char *name;
+  size_t len = Ident(run, &name);
+  if (len && Accept(run, ':')) {
+    if (!DefineLabel(run, name, len)) return false;
+    len = Ident(run, &name);
+  }
+  if (len && !Statement(run, name, len)) return false;
+
+  SkipSpace(run);
+  if (run->p != run->end)
+    return Fail(run, "unexpected '%c'", *run->p);
+  return true;
+}
+
+static bool ApplyFixups(struct Run *run) {
+  struct Assembler *as = run->as;
+  for (size_t i = 0; i < as->fixup_count; i++) {
+    struct AsmFixup *fix = &as->fixups[i];
+    struct AsmLabel *label = FindLabel(as, fix->name, fix->len);
+    run->line = fix->line;
+    if (label->gen != as->gen)
+      return Fail(run, "undefined label %.*s", (int) fix->len, fix->name);
+    if (fix->width == 1 && label->addr > 0xFF)
+      return Fail(run, "%.*s doesn't fit in 8 bits", (int) fix->len,
+        fix->name);
+    Put(run->out + fix->at, label->addr, fix->width);
+  }
+  return true;
+}
+
+bool Assemble(struct Assembler *as, const char *src, size_t len, uint8_t *out,
+    size_t *out_len) {
+  // a new generation empties the label table without touching it
+  if (++as->gen == 0) {
+    memset(as->labels, 0, as->label_cap * sizeof(*as->labels));
+    as->gen = 1;
+  }
+  as->label_count = 0;
+  as->fixup_count = 0;
+  as->err[0] = '\0';
+  as->err_line = 0;
+
+  struct Run run = {.as = as, .out = out};
+  const char *src_end = src + len;
+  for (const char *p = src; p < src_end;) {
+    const char *line_end = memchr(p, '\n', src_end - p);
+    if (!line_end) line_end = src_end;
+    const char *comment = memchr(p, ';', line_end - p);
+
+    run.p = p;
+    run.end = comment ? comment : line_end;
+    run.line++;
+    if (!Line(&run)) return false;
+    p = line_end + 1;
+  }
+
+  if (!ApplyFixups(&run)) return false;
+  *out_len = run.out_len;
+  return true;
+}
+
+bool AssembleIntoVM(struct Assembler *as, const char *src, size_t len,
+    struct VM *vm) {
+  size_t out_len;
+  if (!Assemble(as, src, len, as->image, &out_len)) return false;
+  VMReset(vm);
+  VMWriteMemory(vm, 0, as->image, out_len);
+  return true;
+}
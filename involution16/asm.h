@@ -0,0 +1,86 @@
+#ifndef ASM_H_
+#define ASM_H_
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// assembles the syntax of fasm/involution16.inc, which is also what disasm.c
+// prints, without fasmg:
+//
+//   ; comments run to the end of the line
+//   loop:                     labels may be followed by an instruction
+//     add r1, r2, r3          as for every op in kOpNames but xri, srr, srm
+//     xri r0, loop            an 8 bit number or label, optionally followed
+//     xri r1, 0x05 (005)      by its value in brackets as disasm.c prints it
+//     srr r1, r2, p.cdab      permutations are case insensitive
+//     srm r1, r2
+//     brk
+//     dbg 3                   breakpoint instruction 0xF3F3
+//     db 1, 0x2, label        bytes
+//     dw 0xFFFF, label        little endian words
+//
+// numbers are decimal, hex with a leading 0x or trailing h, or binary with a
+// leading 0b. mnemonics and registers are case insensitive, labels are not.
+// including involution16.inc is accepted and does nothing, so fasmg sources
+// assemble unchanged
+//
+// assembly is a single pass over the source, uses of labels that aren't
+// defined yet are filled in at the end. an Assembler keeps its tables between
+// runs, so assembling many programs with one allocates next to nothing
+
+enum {kAsmErrorCap = 128};
+
+struct AsmLabel {
+  // points into the source being assembled
+  const char *name;
+  uint32_t len;
+  // the label is only defined in the run with the same generation
+  uint32_t gen;
+  uint16_t addr;
+};
+
+struct AsmFixup {
+  const char *name;
+  uint32_t len;
+  // where the value goes in the output, and how many bytes it takes
+  uint32_t at;
+  uint8_t width;
+  size_t line;
+};
+
+struct Assembler {
+  // open addressing hash table of label_cap entries, a power of 2
+  struct AsmLabel *labels;
+  size_t label_cap, label_count;
+  uint32_t gen;
+
+  struct AsmFixup *fixups;
+  size_t fixup_cap, fixup_count;
+
+  // output of AssembleIntoVM before it's copied into the vm
+  uint8_t image[65536];
+
+  // set when a run fails, line counts from 1
+  size_t err_line;
+  char err[kAsmErrorCap];
+};
+
+struct Assembler *AssemblerCreate(void);
+void AssemblerDestroy(struct Assembler *);
+
+// assembles the len bytes of src into out, which must have space for 65536
+// bytes, and stores the length of the output in out_len. returns false with
+// err and err_line set if the source doesn't assemble
+bool Assemble(struct Assembler *, const char *src, size_t len, uint8_t *out,
+  size_t *out_len);
+
+// resets vm with VMReset and assembles src into its memory from address 0, so
+// one vm can be reused for every program. vm is left as it was if the source
+// doesn't assemble
+bool AssembleIntoVM(struct Assembler *, const char *src, size_t len,
+  struct VM *vm);
+
+#endif
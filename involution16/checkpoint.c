@@ -0,0 +1,77 @@
+#include "checkpoint.h"
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+void CheckpointsInit(struct Checkpoints *cps, const struct VM *vm) {
+  cps->snaps[0] = VMSnapshot(vm);
+  cps->count = 1;
+  cps->interval = kCheckpointInterval;
+}
+
+void CheckpointsDestroy(struct Checkpoints *cps) {
+  for (size_t i = 0; i < cps->count; i++)
+    VMSnapshotDestroy(cps->snaps[i]);
+  cps->count = 0;
+}
+
+uint64_t CheckpointsUntilNext(const struct Checkpoints *cps, uint64_t step) {
+  return cps->interval - step % cps->interval;
+}
+
+// whether vm is in the same state as the snapshot, not counting its hook
+static bool SameState(const struct VM *vm, const struct VMSnapshot *snap) {
+  const struct VM *state = &snap->state;
+  if (memcmp(vm->reg, state->reg, sizeof(vm->reg)) != 0 ||
+      vm->pc != state->pc || vm->direction != state->direction ||
+      vm->brk_dir != state->brk_dir || vm->err != state->err)
+    return false;
+
+  for (size_t i = 0; i < kVMPageCount; i++) {
+    const struct VMPage *a = vm->pages[i], *b = state->pages[i];
+    if (a->stamp != b->stamp &&
+        memcmp(a->bytes, b->bytes, sizeof(a->bytes)) != 0)
+      return false;
+  }
+  return true;
+}
+
+void CheckpointsRecord(struct Checkpoints *cps, const struct VM *vm,
+    uint64_t step) {
+  if (step % cps->interval != 0) return;
+  size_t i = step / cps->interval;
+
+  if (i < cps->count) {
+    if (SameState(vm, cps->snaps[i])) return;
+    while (cps->count > i)
+      VMSnapshotDestroy(cps->snaps[--cps->count]);
+  }
+  // only the next checkpoint in line can be recorded, as an earlier gap
+  // couldn't be filled
+  if (i != cps->count) return;
+
+  if (cps->count == kCheckpointCap) {
+    for (size_t j = 0; j < kCheckpointCap; j++) {
+      if (j % 2)
+        VMSnapshotDestroy(cps->snaps[j]);
+      else
+        cps->snaps[j / 2] = cps->snaps[j];
+    }
+    cps->count = kCheckpointCap / 2;
+    cps->interval *= 2;
+    // step is now only due if it's a multiple of the new interval, which
+    // makes it the next in line
+    if (step % cps->interval != 0) return;
+  }
+  cps->snaps[cps->count++] = VMSnapshot(vm);
+}
+
+uint64_t CheckpointsRestore(const struct Checkpoints *cps, struct VM *vm,
+    uint64_t step) {
+  size_t i = step / cps->interval;
+  if (i >= cps->count) i = cps->count - 1;
+  VMRestore(vm, cps->snaps[i]);
+  return i * cps->interval;
+}
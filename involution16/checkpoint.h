@@ -0,0 +1,49 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "involution16.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  // most checkpoints kept. snapshots share unmodified pages with each other
+  // and the VM, so this bounds memory to at most this many copies of the
+  // pages that changed between checkpoints
+  kCheckpointCap = 64,
+  // steps between checkpoints to begin with
+  kCheckpointInterval = 1 << 16,
+};
+
+// snapshots of a VM taken every interval steps as it executes forwards from
+// step 0, so that any step can be reached by restoring the nearest
+// checkpoint before it and replaying the rest. when full, every other
+// checkpoint is dropped and the interval doubles, so seeking never replays
+// more than interval steps however long the run
+struct Checkpoints {
+  // snaps[i] is the state at step i * interval
+  struct VMSnapshot *snaps[kCheckpointCap];
+  size_t count;
+  uint64_t interval;
+};
+
+// vm is the state at step 0
+void CheckpointsInit(struct Checkpoints *, const struct VM *vm);
+void CheckpointsDestroy(struct Checkpoints *);
+
+// steps from step to the next one that should be recorded
+uint64_t CheckpointsUntilNext(const struct Checkpoints *, uint64_t step);
+
+// called with the state reached at step by executing forwards, records it if
+// a checkpoint is due. a state that differs from the one already recorded at
+// step (as happens after stepping backwards through an instruction that
+// doesn't invert) replaces it and drops every checkpoint after it
+void CheckpointsRecord(struct Checkpoints *, const struct VM *vm,
+  uint64_t step);
+
+// sets vm to the state of the latest checkpoint at or before step, keeping
+// its step hook, and returns the step of that checkpoint
+uint64_t CheckpointsRestore(const struct Checkpoints *, struct VM *vm,
+  uint64_t step);
+
+#endif
@@ -0,0 +1,393 @@
+#include "corpus.h"
+
+#include "involution16.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static const char kCorpusMagic[8] = "I16CORPS";
+
+enum {
+  kCorpusVersion = 2,
+
+  kCorpusHeaderLen = sizeof(kCorpusMagic) + 4,
+  // offset, rom length, flags
+  kCorpusIndexEntryLen = 8 + 4 + 4,
+  // index offset, entry count, magic
+  kCorpusFooterLen = 8 + 8 + sizeof(kCorpusMagic),
+
+  kCorpusMaxRomLen = 65536,
+  // pc, registers
+  kCorpusStartLen = 2 + 16 * 2,
+  // step bound, status, error code, steps, pc, registers
+  kCorpusResultLen = 8 + 1 + 1 + 8 + 2 + 16 * 2,
+};
+
+static uint8_t *Put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *Put32(uint8_t *p, uint32_t v) {
+  p = Put16(p, v);
+  return Put16(p, v >> 16);
+}
+
+static uint8_t *Put64(uint8_t *p, uint64_t v) {
+  p = Put32(p, v);
+  return Put32(p, v >> 32);
+}
+
+static uint16_t Get16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t Get32(const uint8_t *p) {
+  return Get16(p) | (uint32_t) Get16(p + 2) << 16;
+}
+
+static uint64_t Get64(const uint8_t *p) {
+  return Get32(p) | (uint64_t) Get32(p + 4) << 32;
+}
+
+// checks the header and footer of a corpus file of len bytes, and finds its
+// index
+static bool ParseFrame(const uint8_t *header, const uint8_t *footer,
+    uint64_t len, uint64_t *index_offset, uint64_t *count) {
+  if (len < kCorpusHeaderLen + kCorpusFooterLen ||
+      memcmp(header, kCorpusMagic, sizeof(kCorpusMagic)) != 0 ||
+      Get32(header + sizeof(kCorpusMagic)) != kCorpusVersion ||
+      memcmp(footer + 16, kCorpusMagic, sizeof(kCorpusMagic)) != 0)
+    return false;
+
+  uint64_t footer_offset = len - kCorpusFooterLen;
+  *index_offset = Get64(footer);
+  *count = Get64(footer + 8);
+  return *index_offset >= kCorpusHeaderLen &&
+    *index_offset <= footer_offset &&
+    (footer_offset - *index_offset) % kCorpusIndexEntryLen == 0 &&
+    *count == (footer_offset - *index_offset) / kCorpusIndexEntryLen;
+}
+
+static void WriteBytes(struct CorpusWriter *w, const void *buf, size_t len) {
+  if (w->error) return;
+  if (fwrite(buf, 1, len, w->file) != len) {
+    w->error = errno ? errno : EIO;
+    return;
+  }
+  w->offset += len;
+}
+
+// reads the index of the existing corpus in file, leaving the file positioned
+// to overwrite it with new entries
+static bool LoadIndex(struct CorpusWriter *w) {
+  struct stat st;
+  if (fstat(fileno(w->file), &st) != 0) return false;
+
+  uint8_t header[kCorpusHeaderLen];
+  uint8_t footer[kCorpusFooterLen];
+  if (st.st_size < kCorpusHeaderLen + kCorpusFooterLen ||
+      fread(header, 1, sizeof(header), w->file) != sizeof(header) ||
+      fseek(w->file, -(long) sizeof(footer), SEEK_END) != 0 ||
+      fread(footer, 1, sizeof(footer), w->file) != sizeof(footer))
+    goto corrupt;
+
+  uint64_t index_offset, count;
+  if (!ParseFrame(header, footer, st.st_size, &index_offset, &count))
+    goto corrupt;
+
+  w->index_cap = count > 64 ? count : 64;
+  w->index = malloc(w->index_cap * sizeof(*w->index));
+  Assume(w->index);
+  if (fseek(w->file, index_offset, SEEK_SET) != 0)
+    goto corrupt;
+  for (size_t i = 0; i < count; i++) {
+    uint8_t entry[kCorpusIndexEntryLen];
+    if (fread(entry, 1, sizeof(entry), w->file) != sizeof(entry))
+      goto corrupt;
+    w->index[i] = (struct CorpusIndexEntry) {
+      .offset = Get64(entry),
+      .rom_len = Get32(entry + 8),
+      .flags = Get32(entry + 12),
+    };
+  }
+  w->index_len = count;
+
+  if (fseek(w->file, index_offset, SEEK_SET) != 0)
+    goto corrupt;
+  w->offset = index_offset;
+  return true;
+
+corrupt:
+  errno = EINVAL;
+  return false;
+}
+
+struct CorpusWriter *CorpusWriterOpen(const char *path) {
+  FILE *file = fopen(path, "r+b");
+  bool existing = file != NULL;
+  if (!file && errno == ENOENT)
+    file = fopen(path, "w+b");
+  if (!file) return NULL;
+
+  struct CorpusWriter *w = calloc(1, sizeof(*w));
+  Assume(w);
+  w->file = file;
+
+  if (existing) {
+    if (!LoadIndex(w)) {
+      int saved_errno = errno;
+      fclose(file);
+      free(w->index);
+      free(w);
+      errno = saved_errno;
+      return NULL;
+    }
+  } else {
+    uint8_t header[kCorpusHeaderLen];
+    memcpy(header, kCorpusMagic, sizeof(kCorpusMagic));
+    Put32(header + sizeof(kCorpusMagic), kCorpusVersion);
+    WriteBytes(w, header, sizeof(header));
+  }
+  return w;
+}
+
+void CorpusWriterAdd(struct CorpusWriter *w, const struct CorpusEntry *e) {
+  if (e->rom_len > kCorpusMaxRomLen) {
+    if (!w->error) w->error = EFBIG;
+    return;
+  }
+
+  if (w->index_len == w->index_cap) {
+    w->index_cap = w->index_cap ? w->index_cap * 2 : 64;
+    w->index = realloc(w->index, w->index_cap * sizeof(*w->index));
+    Assume(w->index);
+  }
+  w->index[w->index_len++] = (struct CorpusIndexEntry) {
+    .offset = w->offset,
+    .rom_len = e->rom_len,
+    .flags = e->flags,
+  };
+
+  WriteBytes(w, e->rom, e->rom_len);
+
+  if (e->flags & kCorpusHasName) {
+    uint8_t len[4];
+    Put32(len, e->name_len);
+    WriteBytes(w, len, sizeof(len));
+    WriteBytes(w, e->name, e->name_len);
+  }
+  if (e->flags & kCorpusHasStart) {
+    uint8_t start[kCorpusStartLen];
+    uint8_t *p = Put16(start, e->start_pc);
+    for (int i = 0; i < 16; i++)
+      p = Put16(p, e->start_reg[i]);
+    WriteBytes(w, start, sizeof(start));
+  }
+  if (e->flags & kCorpusHasResult) {
+    uint8_t result[kCorpusResultLen];
+    uint8_t *p = Put64(result, e->result_max_steps);
+    *p++ = e->result_status;
+    *p++ = e->result_err;
+    p = Put64(p, e->result_steps);
+    p = Put16(p, e->result_pc);
+    for (int i = 0; i < 16; i++)
+      p = Put16(p, e->result_reg[i]);
+    WriteBytes(w, result, sizeof(result));
+  }
+}
+
+bool CorpusWriterFinish(struct CorpusWriter *w) {
+  uint64_t index_offset = w->offset;
+  for (size_t i = 0; i < w->index_len; i++) {
+    uint8_t entry[kCorpusIndexEntryLen];
+    uint8_t *p = Put64(entry, w->index[i].offset);
+    p = Put32(p, w->index[i].rom_len);
+    Put32(p, w->index[i].flags);
+    WriteBytes(w, entry, sizeof(entry));
+  }
+
+  uint8_t footer[kCorpusFooterLen];
+  uint8_t *p = Put64(footer, index_offset);
+  p = Put64(p, w->index_len);
+  memcpy(p, kCorpusMagic, sizeof(kCorpusMagic));
+  WriteBytes(w, footer, sizeof(footer));
+
+  if (fclose(w->file) != 0 && !w->error)
+    w->error = errno;
+
+  int error = w->error;
+  free(w->index);
+  free(w);
+
+  errno = error;
+  return !error;
+}
+
+struct CorpusReader *CorpusOpen(const char *path, bool sequential) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+  }
+  if (st.st_size < kCorpusHeaderLen + kCorpusFooterLen) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int saved_errno = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  struct CorpusReader *r = calloc(1, sizeof(*r));
+  Assume(r);
+  r->map = map;
+  r->map_len = st.st_size;
+
+  uint64_t count;
+  if (!ParseFrame(r->map, r->map + r->map_len - kCorpusFooterLen, r->map_len,
+      &r->index_offset, &count)) {
+    CorpusClose(r);
+    errno = EINVAL;
+    return NULL;
+  }
+  r->index = r->map + r->index_offset;
+  r->count = count;
+
+  // entries are laid out in index order, so reading them in order reads the
+  // file front to back
+  madvise(map, r->map_len, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+  return r;
+}
+
+void CorpusClose(struct CorpusReader *r) {
+  munmap((void *) r->map, r->map_len);
+  free(r);
+}
+
+bool CorpusGet(const struct CorpusReader *r, size_t i,
+    struct CorpusEntry *e) {
+  if (i >= r->count) goto corrupt;
+
+  const uint8_t *entry = r->index + i * kCorpusIndexEntryLen;
+  uint64_t offset = Get64(entry);
+  // each entry runs up to the next one, the last up to the index
+  uint64_t end = i + 1 < r->count ?
+    Get64(entry + kCorpusIndexEntryLen) : r->index_offset;
+  if (offset < kCorpusHeaderLen || offset > end || end > r->index_offset)
+    goto corrupt;
+
+  *e = (struct CorpusEntry) {
+    .rom_len = Get32(entry + 8),
+    .flags = Get32(entry + 12),
+  };
+  const uint8_t *p = r->map + offset;
+  size_t left = end - offset;
+
+  if (e->rom_len > kCorpusMaxRomLen || e->rom_len > left) goto corrupt;
+  e->rom = p;
+  p += e->rom_len;
+  left -= e->rom_len;
+
+  if (e->flags & kCorpusHasName) {
+    if (left < 4) goto corrupt;
+    e->name_len = Get32(p);
+    if (e->name_len > left - 4) goto corrupt;
+    e->name = (const char *) p + 4;
+    p += 4 + e->name_len;
+    left -= 4 + e->name_len;
+  }
+  if (e->flags & kCorpusHasStart) {
+    if (left < kCorpusStartLen) goto corrupt;
+    e->start_pc = Get16(p);
+    for (int i = 0; i < 16; i++)
+      e->start_reg[i] = Get16(p + 2 + i * 2);
+    p += kCorpusStartLen;
+    left -= kCorpusStartLen;
+  }
+  if (e->flags & kCorpusHasResult) {
+    if (left < kCorpusResultLen) goto corrupt;
+    e->result_max_steps = Get64(p);
+    e->result_status = p[8];
+    e->result_err = p[9];
+    e->result_steps = Get64(p + 10);
+    e->result_pc = Get16(p + 18);
+    for (int i = 0; i < 16; i++)
+      e->result_reg[i] = Get16(p + 20 + i * 2);
+    left -= kCorpusResultLen;
+  }
+  if (left != 0) goto corrupt;
+  return true;
+
+corrupt:
+  errno = EINVAL;
+  return false;
+}
+
+bool CorpusProbe(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  uint8_t magic[sizeof(kCorpusMagic)];
+  ssize_t n = read(fd, magic, sizeof(magic));
+  close(fd);
+  return n == sizeof(magic) && memcmp(magic, kCorpusMagic, n) == 0;
+}
+
+struct VM *CorpusCreateVM(const struct CorpusEntry *e) {
+  struct VM *vm = VMCreate();
+  VMWriteMemory(vm, 0, e->rom, e->rom_len);
+  if (e->flags & kCorpusHasStart) {
+    vm->pc = e->start_pc;
+    memcpy(vm->reg, e->start_reg, sizeof(vm->reg));
+  }
+  return vm;
+}
+
+static uint8_t RunStatus(const struct VM *vm) {
+  if (vm->err) return kCorpusError;
+  if (vm->brk_dir == vm->direction) return kCorpusBrk;
+  return kCorpusLimit;
+}
+
+void CorpusSetResult(struct CorpusEntry *e, const struct VM *vm,
+    uint64_t steps, uint64_t max_steps) {
+  e->flags |= kCorpusHasResult;
+  e->result_max_steps = max_steps;
+  e->result_status = RunStatus(vm);
+  e->result_err = vm->err;
+  e->result_steps = steps;
+  e->result_pc = vm->pc;
+  memcpy(e->result_reg, vm->reg, sizeof(e->result_reg));
+}
+
+bool CorpusMatchesResult(const struct CorpusEntry *e, const struct VM *vm,
+    uint64_t steps) {
+  return e->result_status == RunStatus(vm) && e->result_err == vm->err &&
+    e->result_steps == steps && e->result_pc == vm->pc &&
+    memcmp(e->result_reg, vm->reg, sizeof(e->result_reg)) == 0;
+}
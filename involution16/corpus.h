@@ -0,0 +1,126 @@
+#ifndef CORPUS_H_
+#define CORPUS_H_
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// a corpus packs many roms into one file, so a farm over thousands of roms
+// reads one file front to back instead of opening each rom on its own. the
+// file is a header, then the entries back to back, then an index of the
+// entries and a footer:
+//
+//   header  "I16CORPS", version
+//   entry   rom bytes, then the metadata selected by the entry's flags in
+//           the order they're listed below
+//   index   file offset, rom length and flags of every entry
+//   footer  index offset, entry count, "I16CORPS"
+//
+// all integers are little endian. appending rewrites the index and footer
+// after the new entries, so an append that fails part way leaves the file
+// unreadable
+
+// entry flags
+enum {
+  // name length and name, usually the path the rom was packed from
+  kCorpusHasName = 1 << 0,
+  // pc and registers to start from instead of all zero
+  kCorpusHasStart = 1 << 1,
+  // the step bound of a run, then the status, error code, steps, pc and
+  // registers it is expected to end with
+  kCorpusHasResult = 1 << 2,
+};
+
+enum CorpusStatus {
+  kCorpusLimit,
+  kCorpusBrk,
+  kCorpusError,
+};
+
+struct CorpusEntry {
+  const uint8_t *rom;
+  size_t rom_len;
+  uint32_t flags;
+
+  // kCorpusHasName, not nul terminated
+  const char *name;
+  size_t name_len;
+
+  // kCorpusHasStart
+  uint16_t start_pc;
+  uint16_t start_reg[16];
+
+  // kCorpusHasResult
+  uint64_t result_max_steps;
+  uint8_t result_status;
+  uint8_t result_err;
+  uint64_t result_steps;
+  uint16_t result_pc;
+  uint16_t result_reg[16];
+};
+
+struct CorpusIndexEntry {
+  uint64_t offset;
+  uint32_t rom_len;
+  uint32_t flags;
+};
+
+struct CorpusWriter {
+  FILE *file;
+  // where the next entry goes
+  uint64_t offset;
+  // errno of the first failed write, reported by CorpusWriterFinish
+  int error;
+
+  struct CorpusIndexEntry *index;
+  size_t index_len, index_cap;
+};
+
+// opens the corpus at path to append to, creating it if it doesn't exist.
+// returns NULL with errno set on failure, EINVAL if the file exists but isn't
+// a valid corpus
+struct CorpusWriter *CorpusWriterOpen(const char *path);
+// appends an entry. its rom must be at most 65536 bytes
+void CorpusWriterAdd(struct CorpusWriter *, const struct CorpusEntry *);
+// writes the index and footer and closes the corpus. returns false with errno
+// set if writing the corpus failed
+bool CorpusWriterFinish(struct CorpusWriter *);
+
+// the whole corpus is mapped into memory, entries point straight into it
+struct CorpusReader {
+  const uint8_t *map;
+  size_t map_len;
+  const uint8_t *index;
+  uint64_t index_offset;
+  size_t count;
+};
+
+// opens the corpus at path. sequential hints that entries will be read in
+// order, so the kernel reads ahead of them and drops pages already read.
+// returns NULL with errno set on failure, EINVAL if the file isn't a valid
+// corpus
+struct CorpusReader *CorpusOpen(const char *path, bool sequential);
+void CorpusClose(struct CorpusReader *);
+// decodes entry i, which stays valid until the reader is closed. returns
+// false with errno set to EINVAL if the entry is corrupt
+bool CorpusGet(const struct CorpusReader *, size_t i, struct CorpusEntry *);
+
+// whether the file at path starts like a corpus, without checking the rest
+bool CorpusProbe(const char *path);
+
+// creates a VM with the entry's rom written to address 0 and its start state,
+// if it has one
+struct VM *CorpusCreateVM(const struct CorpusEntry *);
+// sets the entry's result to the final state of vm after running steps, in a
+// run bounded by max_steps
+void CorpusSetResult(struct CorpusEntry *, const struct VM *vm,
+  uint64_t steps, uint64_t max_steps);
+// whether vm after running steps matches the entry's result. the run should
+// have been bounded by the entry's result_max_steps
+bool CorpusMatchesResult(const struct CorpusEntry *, const struct VM *vm,
+  uint64_t steps);
+
+#endif
@@ -4,6 +4,9 @@
 #include "disasm.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
@@ -12,10 +15,9 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-// TODO: catch resizes
-
 void Die(const char* msg) {
   perror(msg);
   exit(EXIT_FAILURE);
@@ -46,49 +48,612 @@ void TermiosSetup() {
     Die("tcsetattr");
 }
 
-enum {kRegPaneHeight = 20};
+enum {
+  kRegPaneHeight = 20,
+  // a header and 8 rows
+  kMemPaneHeight = 9,
+  kMemPaneRowBytes = 16,
+  // room past the width of the terminal for the longest line the panes
+  // format, which is cut to the width when it's set
+  kLineSlack = 256,
+  // the least the panes can be drawn in, with a line of assembly
+  kMinRows = kRegPaneHeight + kMemPaneHeight + 2,
+  kMinCols = 4,
+  // steps run between checks for a pause and of the clock while continuing
+  kRunSlice = 1 << 16,
+};
+
+// seconds between the frames published while continuing
+static const double kFrameInterval = 1.0 / 30;
+
+static const char kHexDigits[] = "0123456789ABCDEF";
+
+// sizes the output to the terminal, called again whenever it's resized. the
+// panes are laid out from the size of the output each time they're drawn
+static void FitTerminal(struct Debugger *dbg) {
+  struct winsize w;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1)
+    return;
+  UTuiOutput_Resize(&dbg->output, w.ws_col, w.ws_row);
+}
 
-struct Debugger DebuggerCreate(struct VM *vm) {
+struct Debugger DebuggerCreate(struct VM *vm,
+    const struct Symbols *symbols) {
   struct Debugger dbg;
   dbg.vm = vm;
+  dbg.symbols = symbols;
   dbg.input = UTuiInput_Init();
   dbg.output = UTuiOutput_Init();
   dbg.asm_addr_top = 0xFFFE;
-
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-  UTuiOutput_Resize(&dbg.output, w.ws_col, w.ws_row);
+  dbg.mem_addr_top = 0;
+  dbg.mem_base = VMSnapshot(vm);
+  dbg.step = 0;
+  CheckpointsInit(&dbg.checkpoints, vm);
+
+  memset(dbg.breakpoints, 0, sizeof(dbg.breakpoints));
+  dbg.breakpoint_count = 0;
+  dbg.reg_watches = 0;
+  dbg.mem_watch_count = 0;
+  dbg.command_active = false;
+  dbg.command_len = 0;
+  dbg.status[0] = '\0';
+  dbg.line = NULL;
+  dbg.style = NULL;
+  dbg.line_cap = 0;
+  atomic_init(&dbg.frames.head, 0);
+  atomic_init(&dbg.frames.tail, 0);
+
+  FitTerminal(&dbg);
 
   return dbg;
 }
 
-void DrawAsmPane(struct Debugger *dbg) {
-  size_t height = dbg->output.num_rows - kRegPaneHeight;
+static bool BreakpointAt(const struct Debugger *dbg, uint16_t addr) {
+  return dbg->breakpoints[addr / 64] >> (addr % 64) & 1;
+}
+
+static void ToggleBreakpoint(struct Debugger *dbg, uint16_t addr) {
+  dbg->breakpoint_count += BreakpointAt(dbg, addr) ? -1 : 1;
+  dbg->breakpoints[addr / 64] ^= (uint64_t) 1 << (addr % 64);
+}
+
+static void ToggleMemWatch(struct Debugger *dbg, uint16_t addr) {
+  for (size_t i = 0; i < dbg->mem_watch_count; i++) {
+    if (dbg->mem_watches[i].addr == addr) {
+      dbg->mem_watches[i] = dbg->mem_watches[--dbg->mem_watch_count];
+      return;
+    }
+  }
+
+  if (dbg->mem_watch_count == kDebuggerMaxMemWatches) {
+    snprintf(dbg->status, sizeof(dbg->status), "too many memory watches");
+    return;
+  }
+  dbg->mem_watches[dbg->mem_watch_count++].addr = addr;
+}
+
+// remembers the current values of everything watched, for CheckWatches to
+// compare against
+static void TakeWatchValues(struct Debugger *dbg) {
+  const struct VM *vm = dbg->vm;
+  memcpy(dbg->reg_watch_values, vm->reg, sizeof(vm->reg));
+  for (size_t i = 0; i < dbg->mem_watch_count; i++) {
+    struct DebuggerMemWatch *watch = &dbg->mem_watches[i];
+    watch->value = VMReadByte(vm, watch->addr);
+    watch->stamp = vm->pages[watch->addr / kVMPageSize]->stamp;
+  }
+}
+
+// whether anything watched has changed since TakeWatchValues, describing the
+// change in the status if so
+static bool CheckWatches(struct Debugger *dbg) {
+  const struct VM *vm = dbg->vm;
+  for (int i = 0; i < 16; i++) {
+    if (dbg->reg_watches >> i & 1 && vm->reg[i] != dbg->reg_watch_values[i]) {
+      snprintf(dbg->status, sizeof(dbg->status),
+        "r%X changed from 0x%04X to 0x%04X", i, dbg->reg_watch_values[i],
+        vm->reg[i]);
+      return true;
+    }
+  }
+
+  for (size_t i = 0; i < dbg->mem_watch_count; i++) {
+    struct DebuggerMemWatch *watch = &dbg->mem_watches[i];
+    uint64_t stamp = vm->pages[watch->addr / kVMPageSize]->stamp;
+    if (stamp == watch->stamp) continue;
+
+    watch->stamp = stamp;
+    uint8_t value = VMReadByte(vm, watch->addr);
+    if (value != watch->value) {
+      snprintf(dbg->status, sizeof(dbg->status),
+        "0x%04X changed from 0x%02X to 0x%02X", watch->addr, watch->value,
+        value);
+      return true;
+    }
+  }
+  return false;
+}
+
+// the address of the instruction the vm executes next, which going backwards
+// is the one before pc
+static uint16_t NextInsnAddr(const struct VM *vm) {
+  return vm->direction == kExecutingBackward ? vm->pc - 2 : vm->pc;
+}
+
+// runs up to max_steps in the vm's current direction, returning the steps
+// taken. returns early at a brk or an error and, unless hit is NULL, before
+// an instruction at a breakpoint or after a step that changes something
+// watched, setting *hit and the status
+static uint64_t RunUntilStop(struct Debugger *dbg, uint64_t max_steps,
+    bool *hit) {
+  struct VM *vm = dbg->vm;
+  if (!hit)
+    return ExecuteRun(vm, max_steps);
+
+  bool watching = dbg->reg_watches || dbg->mem_watch_count;
+  *hit = false;
+  if (!dbg->breakpoint_count && !watching)
+    return ExecuteRun(vm, max_steps);
+
+  // the vm runs at full speed up to anything that may stop it: a breakpoint,
+  // or an instruction that may write a watched register or memory. that
+  // instruction is then run on its own and the watches checked after it
+  const struct VMStops stops = {
+    .breakpoints = dbg->breakpoints,
+    .regs = dbg->reg_watches,
+    .mem = dbg->mem_watch_count > 0,
+  };
+  uint64_t steps = 0;
+  while (steps < max_steps) {
+    // the first instruction runs even if it's at a breakpoint, so continuing
+    // from one moves on
+    if (ExecuteRun(vm, 1) == 0) break;
+    steps++;
+    if (watching && CheckWatches(dbg)) {
+      *hit = true;
+      break;
+    }
+
+    steps += ExecuteRunUntil(vm, max_steps - steps, &stops);
+    if (vm->err || vm->brk_dir == vm->direction) break;
+    uint16_t next = NextInsnAddr(vm);
+    if (BreakpointAt(dbg, next)) {
+      snprintf(dbg->status, sizeof(dbg->status), "breakpoint at 0x%04X",
+        next);
+      *hit = true;
+      break;
+    }
+  }
+  return steps;
+}
+
+// RunUntilStop, also counting steps and recording checkpoints on the way
+// forwards
+static uint64_t Advance(struct Debugger *dbg, uint64_t max_steps, bool *hit) {
+  struct VM *vm = dbg->vm;
+  bool forward = vm->direction == kExecutingForward;
+  uint64_t steps = 0;
+  while (steps < max_steps) {
+    // stop at every checkpoint on the way, or at step 0 coming from before
+    // the start
+    uint64_t n = max_steps - steps;
+    if (forward) {
+      uint64_t until = dbg->step < 0 ? (uint64_t) -dbg->step :
+        CheckpointsUntilNext(&dbg->checkpoints, dbg->step);
+      if (n > until) n = until;
+    }
+
+    uint64_t ran = RunUntilStop(dbg, n, hit);
+    steps += ran;
+    dbg->step += forward ? (int64_t) ran : -(int64_t) ran;
+    if (forward && dbg->step >= 0 && !vm->err)
+      CheckpointsRecord(&dbg->checkpoints, vm, dbg->step);
+    if (ran < n || (hit && *hit)) break;
+  }
+  return steps;
+}
+
+// called before the vm is run, so the memory pane highlights what the run
+// changes
+static void ResetMemBase(struct Debugger *dbg) {
+  VMSnapshotDestroy(dbg->mem_base);
+  dbg->mem_base = VMSnapshot(dbg->vm);
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void InputError(void) {
+  TermiosRestore();
+  fprintf(stderr, "input error\n");
+  exit(EXIT_FAILURE);
+}
+
+static void DrawFrame(struct Debugger *dbg, const struct DebuggerFrame *frame,
+  const char *status);
+
+// called by the worker only. returns false if the queue is full
+static bool PushFrame(struct DebuggerFrameQueue *q,
+    struct DebuggerFrame frame) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == kDebuggerFrameCap) return false;
+
+  q->frames[tail % kDebuggerFrameCap] = frame;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+// called by the ui only. returns false if the queue is empty
+static bool PopFrame(struct DebuggerFrameQueue *q,
+    struct DebuggerFrame *frame) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail) return false;
+
+  *frame = q->frames[head % kDebuggerFrameCap];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return true;
+}
+
+static void PublishFrame(struct Debugger *dbg, uint64_t run_steps) {
+  struct DebuggerFrame frame = {
+    .snap = VMSnapshot(dbg->vm),
+    .step = dbg->step,
+    .run_steps = run_steps,
+    .time = Now(),
+  };
+  // the ui hasn't caught up, so it's fine to skip this one
+  if (!PushFrame(&dbg->frames, frame))
+    VMSnapshotDestroy(frame.snap);
+}
+
+// the worker thread of RunInBackground, which owns dbg->vm and the rest of
+// the execution state until it sets run_done. the status is left alone if the
+// run takes all of run_max_steps
+static void *RunWorker(void *arg) {
+  struct Debugger *dbg = arg;
+  struct VM *vm = dbg->vm;
+
+  uint64_t steps = 0;
+  double last_publish = Now();
+  const char *reason = NULL;
+  bool hit = false;
+  while (steps < dbg->run_max_steps) {
+    uint64_t n = dbg->run_max_steps - steps;
+    if (n > kRunSlice) n = kRunSlice;
+    steps += Advance(dbg, n, dbg->run_stops ? &hit : NULL);
+    if (hit) break;
+    if (vm->err) {
+      reason = "error";
+      break;
+    }
+    if (vm->brk_dir == vm->direction) {
+      reason = "brk";
+      break;
+    }
+    if (atomic_load_explicit(&dbg->run_stop, memory_order_relaxed)) {
+      reason = "paused";
+      break;
+    }
+
+    if (Now() - last_publish >= kFrameInterval) {
+      PublishFrame(dbg, steps);
+      last_publish = Now();
+    }
+  }
+
+  if (reason)
+    snprintf(dbg->status, sizeof(dbg->status), "%s", reason);
+  if (reason || hit) {
+    size_t len = strlen(dbg->status);
+    snprintf(dbg->status + len, sizeof(dbg->status) - len,
+      " after %" PRIu64 " steps", steps);
+  }
+
+  atomic_store_explicit(&dbg->run_done, true, memory_order_release);
+  return NULL;
+}
+
+// runs up to max_steps in the vm's current direction on a worker thread,
+// stopping at breakpoints and watches if stops is set, until execution stops
+// or a key is pressed. the frames it publishes are drawn in the meantime
+static void RunInBackground(struct Debugger *dbg, uint64_t max_steps,
+    bool stops) {
+  dbg->run_max_steps = max_steps;
+  dbg->run_stops = stops;
+  atomic_store(&dbg->run_stop, false);
+  atomic_store(&dbg->run_done, false);
+  pthread_t worker;
+  if (pthread_create(&worker, NULL, RunWorker, dbg) != 0) {
+    TermiosRestore();
+    Die("pthread_create");
+  }
+
+  // the frame on screen, and the one before it to measure the rate between
+  struct DebuggerFrame shown = {NULL}, prev = {NULL};
+  while (!atomic_load_explicit(&dbg->run_done, memory_order_acquire)) {
+    UTuiKey key = UTuiInput_ReadKey(&dbg->input,
+      (int) (kFrameInterval * 1000));
+    if (key == kUTuiInputError) InputError();
+    bool fresh = false;
+    if (key == kUTuiResize) {
+      FitTerminal(dbg);
+      // redraw the frame already shown, if a newer one doesn't come
+      fresh = shown.snap;
+    } else if (key != kUTuiKeyNone) {
+      atomic_store_explicit(&dbg->run_stop, true, memory_order_relaxed);
+    }
+
+    struct DebuggerFrame frame;
+    while (PopFrame(&dbg->frames, &frame)) {
+      if (prev.snap) VMSnapshotDestroy(prev.snap);
+      prev = shown;
+      shown = frame;
+      fresh = true;
+    }
+    if (!fresh) continue;
+
+    char status[kDebuggerStatusCap];
+    int n = snprintf(status, sizeof(status), "running, %" PRIu64 " steps",
+      shown.run_steps);
+    if (prev.snap && shown.time > prev.time) {
+      double rate = (shown.run_steps - prev.run_steps) /
+        (shown.time - prev.time);
+      snprintf(status + n, sizeof(status) - n, ", %.0f steps/s", rate);
+    }
+    DrawFrame(dbg, &shown, status);
+  }
+  pthread_join(worker, NULL);
+
+  struct DebuggerFrame frame;
+  while (PopFrame(&dbg->frames, &frame))
+    VMSnapshotDestroy(frame.snap);
+  if (shown.snap) VMSnapshotDestroy(shown.snap);
+  if (prev.snap) VMSnapshotDestroy(prev.snap);
+}
+
+// runs in direction until execution stops or a key is pressed
+static void Continue(struct Debugger *dbg, ExecutionDirection direction) {
+  struct VM *vm = dbg->vm;
+  if (vm->err) return;
+  vm->direction = direction;
+  TakeWatchValues(dbg);
+  ResetMemBase(dbg);
+  RunInBackground(dbg, UINT64_MAX, true);
+}
+
+// restores the nearest checkpoint before step and replays forwards to it in
+// the background, so that a long replay can be watched and paused like a
+// continue. breakpoints and watches don't stop the replay
+static void GoToStep(struct Debugger *dbg, uint64_t step) {
+  struct VM *vm = dbg->vm;
+  dbg->step = CheckpointsRestore(&dbg->checkpoints, vm, step);
+  vm->direction = kExecutingForward;
+  if ((uint64_t) dbg->step == step) return;
+
+  RunInBackground(dbg, step - dbg->step, false);
+  if ((uint64_t) dbg->step != step) {
+    size_t len = strlen(dbg->status);
+    snprintf(dbg->status + len, sizeof(dbg->status) - len,
+      ", at step %" PRId64 " of %" PRIu64, dbg->step, step);
+  }
+}
+
+// parses an address given as a number or the name of a symbol
+static bool ParseAddr(const struct Debugger *dbg, const char *arg,
+    uint16_t *addr) {
+  if (SymbolFind(dbg->symbols, arg, addr)) return true;
+  char *end;
+  unsigned long value = strtoul(arg, &end, 0);
+  if (!*arg || *end || value > 0xFFFF) return false;
+  *addr = value;
+  return true;
+}
+
+// runs the command typed after ':'
+//   b [addr]   toggles a breakpoint at addr, or the pc
+//   w rX       toggles a watch on register X
+//   w addr     toggles a watch on the byte at addr
+//   d          deletes every breakpoint and watch
+//   g step     goes to the given step
+//   m addr     scrolls the memory pane to addr
+// numbers are decimal, or hex with a leading 0x. addresses may also be given
+// by the names of symbols
+static void RunCommand(struct Debugger *dbg) {
+  char cmd[kDebuggerCommandCap + 1];
+  memcpy(cmd, dbg->command, dbg->command_len);
+  cmd[dbg->command_len] = '\0';
+  dbg->status[0] = '\0';
+
+  char *arg = cmd + 1;
+  while (*arg == ' ') arg++;
+  char *end;
+  uint16_t addr;
+  switch (cmd[0]) {
+    case 'b':
+      addr = dbg->vm->pc;
+      if (*arg && !ParseAddr(dbg, arg, &addr)) break;
+      ToggleBreakpoint(dbg, addr);
+      return;
+    case 'w':
+      if (arg[0] == 'r' && arg[1] && !arg[2]) {
+        unsigned long value = strtoul(arg + 1, &end, 16);
+        if (*end) break;
+        dbg->reg_watches ^= 1 << value;
+        return;
+      }
+      if (!ParseAddr(dbg, arg, &addr)) break;
+      ToggleMemWatch(dbg, addr);
+      return;
+    case 'g': {
+      unsigned long long step = strtoull(arg, &end, 0);
+      if (!*arg || *end || *arg == '-') break;
+      ResetMemBase(dbg);
+      GoToStep(dbg, step);
+      return;
+    }
+    case 'm':
+      if (!ParseAddr(dbg, arg, &addr)) break;
+      dbg->mem_addr_top = addr - addr % kMemPaneRowBytes;
+      return;
+    case 'd':
+      if (*arg) break;
+      memset(dbg->breakpoints, 0, sizeof(dbg->breakpoints));
+      dbg->breakpoint_count = 0;
+      dbg->reg_watches = 0;
+      dbg->mem_watch_count = 0;
+      return;
+  }
+  snprintf(dbg->status, sizeof(dbg->status), "unknown command: %s", cmd);
+}
+
+// handles a key typed while the command line is open
+static void CommandKey(struct Debugger *dbg, UTuiKey key) {
+  switch (key) {
+    case kUTuiKeyEscape:
+      dbg->command_active = false;
+      break;
+    case kUTuiKeyEnter:
+      dbg->command_active = false;
+      RunCommand(dbg);
+      break;
+    case kUTuiKeyBackspace:
+      if (dbg->command_len > 0)
+        dbg->command_len--;
+      else
+        dbg->command_active = false;
+      break;
+    default:
+      if (key >= ' ' && key < 0x7F && dbg->command_len < kDebuggerCommandCap)
+        dbg->command[dbg->command_len++] = key;
+      break;
+  }
+}
+
+// makes the scratch line hold a line as wide as the terminal, and returns its
+// size
+static size_t ReserveLine(struct Debugger *dbg) {
+  size_t size = dbg->output.num_cols + kLineSlack;
+  if (dbg->line_cap < size) {
+    dbg->line = realloc(dbg->line, size);
+    dbg->style = realloc(dbg->style, size * sizeof(*dbg->style));
+    if (!dbg->line || !dbg->style)
+      Die("realloc");
+    dbg->line_cap = size;
+  }
+  return size;
+}
+
+// sets row y to the first len chars of the scratch line, cut to the terminal
+static void SetLine(struct Debugger *dbg, size_t y, size_t len) {
+  if (len > dbg->output.num_cols)
+    len = dbg->output.num_cols;
+  UTuiOutput_SetLine(&dbg->output, y, len, dbg->line, dbg->style);
+}
 
-  const size_t min_line_size = 9 + kMaxInsnStrLen + 1;
-  size_t line_size = dbg->output.num_cols;
-  if (line_size < min_line_size)
-    line_size = min_line_size;
+// clears the scratch line to spaces, styled as a header if header is set
+static void ClearLine(struct Debugger *dbg, bool header) {
+  memset(dbg->line, ' ', dbg->line_cap);
+  memset(dbg->style, 0, dbg->line_cap * sizeof(*dbg->style));
+  if (header) {
+    for (size_t i = 0; i < dbg->line_cap; i++)
+      dbg->style[i].attr = kUTuiReverse;
+  }
+}
+
+// the Put functions format into s in place of snprintf, which is slow enough
+// to show when redrawing on every step. they return the chars written
+
+static size_t PutStr(char *s, const char *str) {
+  size_t n = strlen(str);
+  memcpy(s, str, n);
+  return n;
+}
 
-  char *line = malloc(line_size);
-  struct UTuiStyle *style = malloc(line_size * sizeof(*style));
+// value as 0x followed by digits hex digits
+static size_t PutHex(char *s, uint16_t value, size_t digits) {
+  s[0] = '0';
+  s[1] = 'x';
+  for (size_t i = 0; i < digits; i++)
+    s[2 + i] = kHexDigits[value >> 4 * (digits - 1 - i) & 0xF];
+  return 2 + digits;
+}
+
+// value in decimal, right aligned to width
+static size_t PutDec(char *s, int64_t value, size_t width) {
+  char digits[21];
+  size_t n = 0;
+  uint64_t mag = value < 0 ? -(uint64_t) value : (uint64_t) value;
+  do {
+    digits[sizeof(digits) - ++n] = '0' + mag % 10;
+    mag /= 10;
+  } while (mag);
+  if (value < 0)
+    digits[sizeof(digits) - ++n] = '-';
+
+  size_t pad = n < width ? width - n : 0;
+  memset(s, ' ', pad);
+  memcpy(s + pad, digits + sizeof(digits) - n, n);
+  return pad + n;
+}
 
-  memset(line, ' ', dbg->output.num_cols);
-  memset(style, 0, dbg->output.num_cols * sizeof(*style));
-  for (size_t i = 0; i < dbg->output.num_cols; i++) {
-    style[i].attr = kUTuiReverse;
+// after the instruction at addr, which ends at column n of the scratch line,
+// names the symbol at addr, and where the instruction is a jeq that jumps when
+// executed next, where it jumps to. returns the new length of the line
+static size_t DrawAsmNote(struct Debugger *dbg, const struct VM *vm,
+    uint16_t addr, const uint8_t insn[2], size_t n) {
+  const char *label = SymbolAt(dbg->symbols, addr);
+
+  uint16_t next = NextInsnAddr(vm);
+  bool jumps = addr == next && !vm->err && insn[0] >> 4 == kOpJeq &&
+    vm->reg[insn[1] >> 4] == vm->reg[insn[1] & 0xF];
+  if (!label && !jumps) return n;
+
+  // notes line up after the longest instruction without symbols
+  const size_t note_col = 18 + kMaxInsnStrLen + 2;
+  size_t start = n + 2 > note_col ? n + 2 : note_col;
+  n = start;
+  if (label) {
+    n += PutStr(dbg->line + n, label);
+    dbg->line[n++] = ':';
+    dbg->line[n++] = ' ';
+  }
+  if (jumps) {
+    uint16_t target = vm->reg[insn[0] & 0xF];
+    const char *name = SymbolAt(dbg->symbols, target);
+    n += PutStr(dbg->line + n, "-> ");
+    n += name ? PutStr(dbg->line + n, name) : PutHex(dbg->line + n, target, 4);
   }
 
-  snprintf(line, dbg->output.num_cols, " ASSEMBLY src: factorial.bin");
-  UTuiOutput_SetLine(&dbg->output, 0, dbg->output.num_cols, line, style);
+  for (size_t j = start; j < n; j++) {
+    dbg->style[j].fg.kind = kUTuiColorIndexed;
+    dbg->style[j].fg.color[0] = 30 + kDisAsmSym - '0';
+  }
+  return n;
+}
+
+// draws the memory around pc of vm, which may be a published frame rather
+// than vm
+void DrawAsmPane(struct Debugger *dbg, const struct VM *vm) {
+  size_t height = dbg->output.num_rows - kRegPaneHeight - kMemPaneHeight;
+  ReserveLine(dbg);
+  char *line = dbg->line;
+  struct UTuiStyle *style = dbg->style;
+
+  ClearLine(dbg, true);
+  PutStr(line, " ASSEMBLY src: factorial.bin");
+  SetLine(dbg, 0, dbg->output.num_cols);
 
   bool drew_pc = false;
   for (size_t y = 0; y < height - 1; y++) {
     // address + instruction
-    memset(line, ' ', line_size);
-    memset(style, 0, line_size * sizeof(*style));
+    ClearLine(dbg, false);
 
-    DisAsmFmt fmt[kMaxInsnStrLen];
+    DisAsmFmt fmt[kMaxSymInsnStrLen];
 
     const size_t prefix_len = 18;
     for (size_t j = 0; j < 8; j++) {
@@ -102,20 +667,26 @@ void DrawAsmPane(struct Debugger *dbg) {
     }
 
     uint16_t insn_addr = dbg->asm_addr_top + (y - drew_pc) * 2;
-    if (!drew_pc && dbg->vm->pc == insn_addr) {
-      size_t n = snprintf(line, line_size, " ------  ------  PROGRAM COUNTER");
+    if (!drew_pc && vm->pc == insn_addr) {
+      size_t n = PutStr(line, " ------  ------  PROGRAM COUNTER");
       for (size_t j = prefix_len-1; j < n; j++) {
         style[j].attr = kUTuiBold;
       }
-      UTuiOutput_SetLine(&dbg->output, y + 1, n, line, style);
+      SetLine(dbg, y + 1, n);
       drew_pc = true;
       continue;
     }
 
-    snprintf(line, line_size, " 0x%04X  0x%02X%02X  ",
-      insn_addr, dbg->vm->memory[insn_addr], dbg->vm->memory[insn_addr+1]);
+    uint8_t insn[2];
+    VMReadMemory(vm, insn_addr, insn, sizeof(insn));
+    line[0] = BreakpointAt(dbg, insn_addr) ? '*' : ' ';
+    PutHex(line + 1, insn_addr, 4);
+    PutHex(line + 9, insn[0] << 8 | insn[1], 4);
+    style[0].fg.kind = kUTuiColorIndexed;
+    style[0].fg.color[0] = 31;
+    style[0].attr = kUTuiBold;
 
-    size_t n = InsnToStr(dbg->vm->memory + insn_addr, line + prefix_len, fmt);
+    size_t n = InsnToStrSym(insn, dbg->symbols, line + prefix_len, fmt);
 
     // convert DisAsmFmt to UTuiStyle
     for (size_t j = 0; j < n; j++) {
@@ -124,29 +695,55 @@ void DrawAsmPane(struct Debugger *dbg) {
     }
 
     n += prefix_len;
+    line[n] = ' ';
+    n = DrawAsmNote(dbg, vm, insn_addr, insn, n);
 
-    UTuiOutput_SetLine(&dbg->output, y + 1, n, line, style);
+    SetLine(dbg, y + 1, n);
+  }
+}
+
+// one row of the register pane, with the value colored if it isn't 0
+static void DrawRegLine(struct Debugger *dbg, size_t y, char mark,
+    const char *name, uint16_t value) {
+  char *line = dbg->line;
+  struct UTuiStyle *style = dbg->style;
+
+  uint8_t color = value ? 34 : 0;
+  for (size_t i = 8; i < dbg->line_cap; i++) {
+    style[i].fg.kind = kUTuiColorIndexed;
+    style[i].fg.color[0] = color;
   }
+
+  // the name is right aligned after the mark
+  line[0] = mark;
+  memset(line + 1, ' ', 6);
+  PutStr(line + 7 - strlen(name), name);
+  size_t n = 7;
+  line[n++] = ' ';
+  line[n++] = ' ';
+  n += PutHex(line + n, value, 4);
+  line[n++] = ' ';
+  line[n++] = ' ';
+  n += PutDec(line + n, value, 5);
+  SetLine(dbg, y, n);
 }
 
 // TODO: show error down here
-void DrawRegPane(struct Debugger *dbg) {
-  char *line = malloc(dbg->output.num_cols);
-  struct UTuiStyle *style = malloc(dbg->output.num_cols * sizeof(*style));
+void DrawRegPane(struct Debugger *dbg, const struct VM *vm, int64_t step,
+    const char *status) {
+  ReserveLine(dbg);
+  char *line = dbg->line;
+  struct UTuiStyle *style = dbg->style;
 
   size_t y = dbg->output.num_rows - kRegPaneHeight;
 
-  memset(line, ' ', dbg->output.num_cols);
-  memset(style, 0, dbg->output.num_cols * sizeof(*style));
-  for (size_t i = 0; i < dbg->output.num_cols; i++) {
-    style[i].attr = kUTuiReverse;
-  }
-
-  snprintf(line, dbg->output.num_cols, " REGISTERS");
-  UTuiOutput_SetLine(&dbg->output, y, dbg->output.num_cols, line, style);
+  ClearLine(dbg, true);
+  size_t n = PutStr(line, " REGISTERS  step ");
+  PutDec(line + n, step, 0);
+  SetLine(dbg, y, dbg->output.num_cols);
   y++;
 
-  memset(style, 0, dbg->output.num_cols * sizeof(*style));
+  ClearLine(dbg, false);
   assert(dbg->output.num_cols >= 4);
   // bold the name of the register
   for (size_t i = 0; i < 8; i++) {
@@ -164,52 +761,116 @@ void DrawRegPane(struct Debugger *dbg) {
   }
 
   // show pc
-  uint8_t color = dbg->vm->pc ? 34 : 0;
-  for (size_t i = 8; i < dbg->output.num_cols; i++) {
-    style[i].fg.kind = kUTuiColorIndexed;
-    style[i].fg.color[0] = color;
-  }
-  size_t n = snprintf(line, dbg->output.num_cols, " pcnext  0x%04X  %5u", dbg->vm->pc, dbg->vm->pc);
-  UTuiOutput_SetLine(&dbg->output, y, n, line, style);
-  y++;
-  uint16_t pc_p = dbg->vm->pc - 2;
-  color = pc_p ? 34 : 0;
-  for (size_t i = 8; i < dbg->output.num_cols; i++) {
-    style[i].fg.kind = kUTuiColorIndexed;
-    style[i].fg.color[0] = color;
-  }
-  n = snprintf(line, dbg->output.num_cols, " pcprev  0x%04X  %5u", pc_p, pc_p);
-  UTuiOutput_SetLine(&dbg->output, y, n, line, style);
-  y++;
+  DrawRegLine(dbg, y++, ' ', "pcnext", vm->pc);
+  DrawRegLine(dbg, y++, ' ', "pcprev", vm->pc - 2);
 
   // show remaining registers
+  static const char *const kRegNames[16] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+    "r8", "r9", "rA", "rB", "rC", "rD", "rE", "rF",
+  };
   for (int i = 0; i < 16; i++) {
-    uint8_t color = dbg->vm->reg[i] ? 34 : 0;
-    for (size_t i = 8; i < dbg->output.num_cols; i++) {
-      style[i].fg.kind = kUTuiColorIndexed;
-      style[i].fg.color[0] = color;
-    }
-    size_t n = snprintf(line, dbg->output.num_cols, "     r%X  0x%04X  %5u", i, dbg->vm->reg[i], dbg->vm->reg[i]);
-    UTuiOutput_SetLine(&dbg->output, y, n, line, style);
-    y++;
+    DrawRegLine(dbg, y++, dbg->reg_watches >> i & 1 ? '*' : ' ', kRegNames[i],
+      vm->reg[i]);
   }
 
-  memset(line, ' ', dbg->output.num_cols);
-  memset(style, 0, dbg->output.num_cols * sizeof(*style));
-  for (size_t i = 0; i < dbg->output.num_cols; i++) {
-    style[i].attr = kUTuiReverse;
+  ClearLine(dbg, true);
+  if (dbg->command_active) {
+    line[0] = ':';
+    memcpy(line + 1, dbg->command, dbg->command_len);
+  } else {
+    n = PutStr(line, " error: ");
+    n += PutStr(line + n, kErrorStrings[vm->err]);
+    n += 4;
+    PutStr(line + n, status);
   }
+  SetLine(dbg, y, dbg->output.num_cols);
+}
+
+// hex dump of memory from mem_addr_top, with the bytes that changed since
+// mem_base was taken highlighted
+void DrawMemPane(struct Debugger *dbg, const struct VM *vm) {
+  // address, hex bytes, then ascii
+  const size_t hex_col = 9;
+  const size_t ascii_col = hex_col + kMemPaneRowBytes * 3 + 1;
+  const size_t row_len = ascii_col + kMemPaneRowBytes;
+  ReserveLine(dbg);
+  char *line = dbg->line;
+  struct UTuiStyle *style = dbg->style;
+
+  size_t y = dbg->output.num_rows - kRegPaneHeight - kMemPaneHeight;
+
+  ClearLine(dbg, true);
+  PutStr(line, " MEMORY");
+  SetLine(dbg, y, dbg->output.num_cols);
+  y++;
+
+  const struct VM *base = &dbg->mem_base->state;
+  for (size_t row = 0; row < kMemPaneHeight - 1; row++) {
+    uint16_t addr = dbg->mem_addr_top + row * kMemPaneRowBytes;
+    ClearLine(dbg, false);
+    for (size_t j = 0; j < hex_col - 1; j++) {
+      style[j].bg.kind = kUTuiColorIndexed;
+      style[j].bg.color[0] = 47;
+    }
+    PutHex(line + 1, addr, 4);
+
+    // rows never straddle a page, as pages are a multiple of the row size
+    const struct VMPage *page = vm->pages[addr / kVMPageSize];
+    const struct VMPage *base_page = base->pages[addr / kVMPageSize];
+    bool page_changed = page->stamp != base_page->stamp;
+
+    for (size_t j = 0; j < kMemPaneRowBytes; j++) {
+      uint8_t byte = page->bytes[(addr + j) % kVMPageSize];
+      line[hex_col + j * 3] = kHexDigits[byte >> 4];
+      line[hex_col + j * 3 + 1] = kHexDigits[byte & 0xF];
+      line[ascii_col + j] = byte >= ' ' && byte < 0x7F ? byte : '.';
+
+      if (page_changed && byte != base_page->bytes[(addr + j) % kVMPageSize]) {
+        struct UTuiStyle changed = {
+          .fg = {kUTuiColorIndexed, {31}},
+          .attr = kUTuiBold,
+        };
+        style[hex_col + j * 3] = changed;
+        style[hex_col + j * 3 + 1] = changed;
+        style[ascii_col + j] = changed;
+      }
+    }
 
-  snprintf(line, dbg->output.num_cols, " error: %s", kErrorStrings[dbg->vm->err]);
-  UTuiOutput_SetLine(&dbg->output, y, dbg->output.num_cols, line, style);
+    SetLine(dbg, y, row_len);
+    y++;
+  }
+}
 
-  free(style);
-  free(line);
+// when the terminal is too small for the panes, says so in place of them and
+// returns true
+static bool DrawTooSmall(struct Debugger *dbg) {
+  if (dbg->output.num_rows >= kMinRows && dbg->output.num_cols >= kMinCols)
+    return false;
+  if (dbg->output.num_rows == 0) return true;
+
+  ReserveLine(dbg);
+  ClearLine(dbg, true);
+  size_t n = PutStr(dbg->line, " terminal too small");
+  SetLine(dbg, 0, n);
+  UTuiOutput_Flip(&dbg->output);
+  return true;
 }
 
 void DrawDebugger(struct Debugger *dbg) {
-  DrawAsmPane(dbg);
-  DrawRegPane(dbg);
+  if (DrawTooSmall(dbg)) return;
+  DrawAsmPane(dbg, dbg->vm);
+  DrawMemPane(dbg, dbg->vm);
+  DrawRegPane(dbg, dbg->vm, dbg->step, dbg->status);
+  UTuiOutput_Flip(&dbg->output);
+}
+
+static void DrawFrame(struct Debugger *dbg, const struct DebuggerFrame *frame,
+    const char *status) {
+  if (DrawTooSmall(dbg)) return;
+  DrawAsmPane(dbg, &frame->snap->state);
+  DrawMemPane(dbg, &frame->snap->state);
+  DrawRegPane(dbg, &frame->snap->state, frame->step, status);
   UTuiOutput_Flip(&dbg->output);
 }
 
@@ -221,10 +882,15 @@ void RunDebugger(struct Debugger *dbg) {
 
     UTuiKey key = UTuiInput_ReadKey(&dbg->input, -1);
     if (key == kUTuiKeyNone) continue;
-    if (key == kUTuiInputError) {
-      TermiosRestore();
-      fprintf(stderr, "input error\n");
-      exit(EXIT_FAILURE);
+    if (key == kUTuiInputError) InputError();
+    if (key == kUTuiResize) {
+      FitTerminal(dbg);
+      continue;
+    }
+
+    if (dbg->command_active) {
+      CommandKey(dbg, key);
+      continue;
     }
 
     switch (key & kUTuiKeyBaseMask) {
@@ -242,13 +908,25 @@ void RunDebugger(struct Debugger *dbg) {
         if (dbg->vm->err) break;
         // TODO: error handling
         dbg->vm->direction = kExecutingForward;
-        ExecuteStep(dbg->vm);
+        ResetMemBase(dbg);
+        Advance(dbg, 1, NULL);
         break;
       case 'p':
         if (dbg->vm->err) break;
         // TODO: error handling
         dbg->vm->direction = kExecutingBackward;
-        ExecuteStep(dbg->vm);
+        ResetMemBase(dbg);
+        Advance(dbg, 1, NULL);
+        break;
+      case 'c':
+        Continue(dbg, kExecutingForward);
+        break;
+      case 'r':
+        Continue(dbg, kExecutingBackward);
+        break;
+      case ':':
+        dbg->command_active = true;
+        dbg->command_len = 0;
         break;
       case kUTuiUpArrow:
         dbg->asm_addr_top -= 2;
@@ -256,6 +934,12 @@ void RunDebugger(struct Debugger *dbg) {
       case kUTuiDownArrow:
         dbg->asm_addr_top += 2;
         break;
+      case kUTuiPageUp:
+        dbg->mem_addr_top -= (kMemPaneHeight - 1) * kMemPaneRowBytes;
+        break;
+      case kUTuiPageDown:
+        dbg->mem_addr_top += (kMemPaneHeight - 1) * kMemPaneRowBytes;
+        break;
     }
   }
 }
\ No newline at end of file
@@ -1,11 +1,83 @@
 #ifndef DEBUGGER_H_
 #define DEBUGGER_H_
 
+#include "checkpoint.h"
 #include "involution16.h"
+#include "symbols.h"
 #include "utui.h"
 
+#include <stdatomic.h>
+
+enum {
+  kDebuggerMaxMemWatches = 16,
+  kDebuggerCommandCap = 64,
+  kDebuggerStatusCap = 128,
+};
+
+// a byte of memory that stops execution when its value changes. stamp is the
+// stamp of its page when value was read, so unchanged pages aren't reread
+struct DebuggerMemWatch {
+  uint16_t addr;
+  uint8_t value;
+  uint64_t stamp;
+};
+
+// the state of a run going on in the background, published for the ui to
+// draw
+struct DebuggerFrame {
+  struct VMSnapshot *snap;
+  int64_t step;
+  // steps taken since the run started, and when the frame was taken
+  uint64_t run_steps;
+  double time;
+};
+
+enum {kDebuggerFrameCap = 4};
+
+// lock free queue of frames from the thread running the vm to the ui
+struct DebuggerFrameQueue {
+  struct DebuggerFrame frames[kDebuggerFrameCap];
+  // only advanced by the ui and the worker respectively
+  _Atomic size_t head, tail;
+};
+
 struct Debugger {
   struct VM *vm;
+  // names shown for addresses in the assembly pane and accepted by commands,
+  // may be NULL
+  const struct Symbols *symbols;
+  // steps taken since the debugger started, going down when stepping
+  // backwards
+  int64_t step;
+  // recorded while executing forwards from step 0 to jump back to any step
+  struct Checkpoints checkpoints;
+
+  // execution stops before the instruction at any address whose bit is set,
+  // in either direction, laid out as struct VMStops takes them
+  uint64_t breakpoints[65536 / 64];
+  size_t breakpoint_count;
+  // registers that stop execution when their value changes, one bit each,
+  // and their values as of the last stop
+  uint16_t reg_watches;
+  uint16_t reg_watch_values[16];
+  struct DebuggerMemWatch mem_watches[kDebuggerMaxMemWatches];
+  size_t mem_watch_count;
+
+  // the command typed after ':', while command_active
+  bool command_active;
+  char command[kDebuggerCommandCap];
+  size_t command_len;
+  // shown on the bottom line after the error
+  char status[kDebuggerStatusCap];
+
+  // while continuing or going to a step, the vm runs on a worker thread for
+  // up to run_max_steps, stopping at breakpoints and watches if run_stops is
+  // set, until it stops or the ui sets run_stop, then sets run_done
+  uint64_t run_max_steps;
+  bool run_stops;
+  struct DebuggerFrameQueue frames;
+  atomic_bool run_stop;
+  atomic_bool run_done;
 
   struct UTuiInput input;
   struct UTuiOutput output;
@@ -13,10 +85,22 @@ struct Debugger {
   // the address of the first line of text on the window in the VM's memory
   uint16_t asm_addr_top;
 
-  // TODO: scratch line buffer
+  // memory pane data
+  // the address of the first byte shown
+  uint16_t mem_addr_top;
+  // the state as of the last stop, bytes that differ from it are highlighted.
+  // pages whose stamp is unchanged are known not to differ without looking
+  struct VMSnapshot *mem_base;
+
+  // buffers each line is built in before being handed to the output, grown
+  // as the terminal widens and kept between frames
+  char *line;
+  struct UTuiStyle *style;
+  size_t line_cap;
 };
 
-struct Debugger DebuggerCreate(struct VM *vm);
+// symbols may be NULL, and must outlive the debugger otherwise
+struct Debugger DebuggerCreate(struct VM *vm, const struct Symbols *symbols);
 void RunDebugger(struct Debugger *dbg);
 
 #endif
\ No newline at end of file
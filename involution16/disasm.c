@@ -1,12 +1,9 @@
 #include "disasm.h"
 #include "involution16.h"
 
-#include <stdio.h>
 #include <assert.h>
 #include <string.h>
 
-// TODO: debug labels
-
 const char *kOpNames[] = {
   [kOpAdd] = "add",
   [kOpSub] = "sub",
@@ -26,89 +23,131 @@ const char *kOpNames[] = {
   [kOpBrk] = "brk",
 };
 
+// how each op is written, as the text and DisAsmFmt of an instruction with
+// every field 0, and the columns of the fields that are then filled in. 0
+// means the op doesn't show that field
+struct InsnTemplate {
+  char text[kMaxInsnStrLen + 1];
+  char fmt[kMaxInsnStrLen + 1];
+  uint8_t len;
+  // hex digits of the operand fields in order
+  uint8_t x, y, z;
+  // two hex digits of the immediate, followed by three decimal ones at dec
+  uint8_t hex, dec;
+  // name of the srr permutation
+  uint8_t perm;
+};
+
+#define RRR_TEMPLATE(name) \
+  {name " r0, r0, r0", "11102260226022", 14, .x = 5, .y = 9, .z = 13}
+
+static const struct InsnTemplate kTemplates[16] = {
+  [kOpAdd] = RRR_TEMPLATE("add"),
+  [kOpSub] = RRR_TEMPLATE("sub"),
+  [kOpRor] = RRR_TEMPLATE("ror"),
+  [kOpRol] = RRR_TEMPLATE("rol"),
+  [kOpShr] = RRR_TEMPLATE("shr"),
+  [kOpShl] = RRR_TEMPLATE("shl"),
+  [kOpAnd] = RRR_TEMPLATE("and"),
+  [kOpOra] = RRR_TEMPLATE("ora"),
+  [kOpMul] = RRR_TEMPLATE("mul"),
+  [kOpDiv] = RRR_TEMPLATE("div"),
+  [kOpCmp] = RRR_TEMPLATE("cmp"),
+  [kOpJeq] = RRR_TEMPLATE("jeq"),
+  [kOpXri] = {"xri r0, 0x00 (000)", "111022603333044444", 18,
+    .x = 5, .hex = 10, .dec = 14},
+  [kOpSrr] = {"srr r0, r0, p.ABCD", "111022602260555555", 18,
+    .x = 5, .y = 9, .perm = 14},
+  [kOpSrm] = {"srm r0, r0", "1110226022", 10, .x = 5, .y = 9},
+  [kOpBrk] = {"brk", "111", 3},
+};
+
+static const char kHexDigits[] = "0123456789ABCDEF";
+
 size_t InsnToStr(uint8_t *insn, char *s, DisAsmFmt *fmt) {
-  uint8_t field[4] = {
-    insn[0] >> 4,
-    insn[0] & 0xF,
-    insn[1] >> 4,
-    insn[1] & 0xF
-  };
+  const struct InsnTemplate *t = &kTemplates[insn[0] >> 4];
+  // whole templates are copied, as a fixed size copy is a few moves
+  memcpy(s, t->text, sizeof(t->text));
+  if (fmt != NULL)
+    memcpy(fmt, t->fmt, kMaxInsnStrLen);
 
-  switch (field[0]) {
-    // three register operands
-    case kOpAdd:
-    case kOpSub:
-    case kOpRor:
-    case kOpRol:
-    case kOpShr:
-    case kOpShl:
-    case kOpAnd:
-    case kOpOra:
-    case kOpMul:
-    case kOpDiv:
-    case kOpCmp:
-    case kOpJeq: {
-      int n = snprintf(s, kMaxInsnStrLen + 1, "%s r%X, r%X, r%X",
-        kOpNames[field[0]], field[1], field[2], field[3]);
-      assert(n > 0);
-      if (fmt != NULL) {
-        const char *fmt_str = "11102260226022";
-        memcpy(fmt, fmt_str, n);
-      }
-      return n;
-    };
-    case kOpXri: {
-      int n = snprintf(s, kMaxInsnStrLen + 1, "xri r%X, 0x%02X (%03u)",
-        field[1], insn[1], insn[1]);
-      assert(n > 0);
-      if (fmt != NULL) {
-        const char *fmt_str = "111022603333044444";
-        memcpy(fmt, fmt_str, n);
-      }
-      return n;
-    }
-    case kOpSrr: {
-      if (field[3] >= kSrrCodeCount) {
-        int n = snprintf(s, kMaxInsnStrLen + 1,"srr r%X, r%X, p.invalid",
-          field[1], field[2]);
-        assert(n > 0);
-        if (fmt != NULL) {
-          const char *fmt_str = "111022602260555555555";
-          memcpy(fmt, fmt_str, n);
-        }
-        return n;
-      }
-      // permutation for given srr parameter
-      const uint8_t *p = kSrrCodes[field[3]];
-      int n = snprintf(s, kMaxInsnStrLen + 1, "srr r%X, r%X, p.%c%c%c%c",
-        field[1], field[2], 'A' + p[0], 'A' + p[1], 'A' + p[2], 'A' + p[3]);
-      assert(n > 0);
-      if (fmt != NULL) {
-        const char *fmt_str = "111022602260555555";
-        memcpy(fmt, fmt_str, n);
-      }
-      return n;
-    }
-    case kOpSrm: {
-      int n = snprintf(s, kMaxInsnStrLen + 1, "srm r%X, r%X",
-        field[1], field[2]);
-      assert(n > 0);
-      if (fmt != NULL) {
-        const char *fmt_str = "1110226022";
-        memcpy(fmt, fmt_str, n);
-      }
-      return n;
+  uint8_t field[3] = {insn[0] & 0xF, insn[1] >> 4, insn[1] & 0xF};
+  if (t->x) s[t->x] = kHexDigits[field[0]];
+  if (t->y) s[t->y] = kHexDigits[field[1]];
+  if (t->z) s[t->z] = kHexDigits[field[2]];
+  if (t->hex) {
+    s[t->hex] = kHexDigits[field[1]];
+    s[t->hex + 1] = kHexDigits[field[2]];
+    s[t->dec] = '0' + insn[1] / 100;
+    s[t->dec + 1] = '0' + insn[1] / 10 % 10;
+    s[t->dec + 2] = '0' + insn[1] % 10;
+  }
+
+  size_t n = t->len;
+  if (t->perm) {
+    if (field[2] >= kSrrCodeCount) {
+      memcpy(s + t->perm, "invalid", 8);
+      if (fmt != NULL)
+        memset(fmt + t->perm, kDisAsmPerm, 7);
+      return t->perm + 7;
     }
-    case kOpBrk: {
-      int n = snprintf(s, kMaxInsnStrLen + 1, "brk");
-      assert(n > 0);
+    for (size_t j = 0; j < 4; j++)
+      s[t->perm + j] = 'A' + kSrrCodes[field[2]][j];
+  }
+  return n;
+}
+
+// appends str to s, returning its length
+static size_t Append(char *s, const char *str) {
+  size_t n = strlen(str);
+  memcpy(s, str, n);
+  return n;
+}
+
+size_t InsnToStrSym(uint8_t *insn, const struct Symbols *syms, char *s,
+    DisAsmFmt *fmt) {
+  // 0 is far more often a constant than the start of memory
+  const char *name = insn[0] >> 4 == kOpXri && insn[1] ?
+    SymbolAt(syms, insn[1]) : NULL;
+  if (!name) return InsnToStr(insn, s, fmt);
+
+  size_t n = Append(s, "xri r");
+  s[n++] = kHexDigits[insn[0] & 0xF];
+  n += Append(s + n, ", ");
+  n += Append(s + n, name);
+  s[n] = '\0';
+  if (fmt != NULL) {
+    const char *fmt_str = "11102260";
+    memcpy(fmt, fmt_str, 8);
+    memset(fmt + 8, kDisAsmSym, n - 8);
+  }
+  return n;
+}
+
+size_t DisasmRange(const uint8_t *mem, size_t len, const struct Symbols *syms,
+    char *out, DisAsmFmt *fmt) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += 2) {
+    const char *label = SymbolAt(syms, i);
+    if (label) {
+      size_t label_len = Append(out + n, label);
+      out[n + label_len] = ':';
+      out[n + label_len + 1] = '\n';
       if (fmt != NULL) {
-        const char *fmt_str = "111";
-        memcpy(fmt, fmt_str, n);
+        memset(fmt + n, kDisAsmSym, label_len + 1);
+        fmt[n + label_len + 1] = kDisAsmSpace;
       }
-      return n;
+      n += label_len + 2;
     }
-  }
 
-  assert(0);
-}
\ No newline at end of file
+    // a trailing odd byte is followed by the brk that fills the rest of
+    // memory
+    uint8_t insn[2] = {mem[i], i + 1 < len ? mem[i + 1] : 0xFF};
+    n += InsnToStrSym(insn, syms, out + n, fmt ? fmt + n : NULL);
+    out[n] = '\n';
+    if (fmt != NULL)
+      fmt[n] = kDisAsmSpace;
+    n++;
+  }
+  return n;
+}
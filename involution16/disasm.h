@@ -1,13 +1,21 @@
 #ifndef DISASM_H_
 #define DISASM_H_
 
+#include "symbols.h"
+
 #include <stdint.h>
 #include <stddef.h>
 
 enum {
   // longest disassembly is 21 chars:
   //   srr r1, r2, p.invalid
-  kMaxInsnStrLen = 18,
+  kMaxInsnStrLen = 21,
+  // or with symbols, an xri naming the longest symbol:
+  //   xri r1, <kSymbolMaxLen chars>
+  kMaxSymInsnStrLen = 8 + kSymbolMaxLen,
+  // most chars DisasmRange writes for an instruction, which is a label line
+  // and the instruction on a line of its own
+  kMaxDisasmLineLen = kSymbolMaxLen + 2 + kMaxSymInsnStrLen + 1,
 };
 
 // used for syntax highlighting
@@ -20,12 +28,31 @@ enum {
   kDisAsmLitDec = '4',
   kDisAsmPerm   = '5',
   kDisAsmComma  = '6',
+  kDisAsmSym    = '7',
 };
 
+// mnemonic of each opcode
+extern const char *kOpNames[];
+
 // insn must be two bytes
 // s must have space for at least kMaxInsnStrLen + 1 chars
 // DisAsmKind must have space for at least kMaxInsnStrLen chars, or be NULL
 // returns number of chars written to s, not including null terminator
 size_t InsnToStr(uint8_t *insn, char *s, DisAsmFmt *fmt);
 
+// as InsnToStr, except that an xri whose nonzero immediate is the address of a
+// symbol names the symbol in its place, as it would be written in the source.
+// s must have space for kMaxSymInsnStrLen + 1 chars instead, and fmt for
+// kMaxSymInsnStrLen chars. syms may be NULL
+size_t InsnToStrSym(uint8_t *insn, const struct Symbols *syms, char *s,
+  DisAsmFmt *fmt);
+
+// disassembles the len bytes of mem, taken to be at address 0, an instruction
+// per line. each labelled instruction gets a line with the name of its symbol
+// first, as in the source. out and fmt must have space for
+// kMaxDisasmLineLen chars per instruction, fmt may be NULL. syms may be NULL.
+// returns the number of chars written, with no null terminator
+size_t DisasmRange(const uint8_t *mem, size_t len, const struct Symbols *syms,
+  char *out, DisAsmFmt *fmt);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,339 @@
+#include "farm.h"
+
+#include "corpus.h"
+#include "involution16.h"
+#include "rom.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct PathList {
+  char **paths;
+  size_t count, cap;
+};
+
+static void PathListAppend(struct PathList *l, char *path) {
+  if (l->count == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 64;
+    l->paths = realloc(l->paths, l->cap * sizeof(*l->paths));
+    Assume(l->paths);
+  }
+  l->paths[l->count++] = path;
+}
+
+static int ComparePaths(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static char **CollectDir(const char *dir_path, size_t *count) {
+  DIR *dir = opendir(dir_path);
+  if (!dir) return NULL;
+
+  struct PathList l = {0};
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    size_t path_len = strlen(dir_path) + 1 + strlen(ent->d_name) + 1;
+    char *path = malloc(path_len);
+    Assume(path);
+    snprintf(path, path_len, "%s/%s", dir_path, ent->d_name);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      PathListAppend(&l, path);
+    } else {
+      free(path);
+    }
+  }
+  closedir(dir);
+
+  // readdir order is arbitrary, sort so runs over the same directory hand out
+  // work in the same order
+  qsort(l.paths, l.count, sizeof(*l.paths), ComparePaths);
+  *count = l.count;
+  // always return a valid pointer, even for an empty directory
+  PathListAppend(&l, NULL);
+  return l.paths;
+}
+
+static char **CollectManifest(const char *manifest_path, size_t *count) {
+  FILE *f = fopen(manifest_path, "r");
+  if (!f) return NULL;
+
+  struct PathList l = {0};
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t n;
+  while ((n = getline(&line, &line_cap, f)) != -1) {
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+    if (n == 0 || line[0] == '#') continue;
+
+    char *path = strdup(line);
+    Assume(path);
+    PathListAppend(&l, path);
+  }
+  free(line);
+  fclose(f);
+
+  *count = l.count;
+  PathListAppend(&l, NULL);
+  return l.paths;
+}
+
+char **FarmCollectRoms(const char *path, size_t *count) {
+  struct stat st;
+  if (stat(path, &st) != 0) return NULL;
+
+  if (S_ISDIR(st.st_mode))
+    return CollectDir(path, count);
+  return CollectManifest(path, count);
+}
+
+// ranges of rom indices are packed into a single word, so that the owner and
+// thieves can both claim work with a single compare and swap
+static uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return (uint64_t) begin << 32 | end;
+}
+
+static uint32_t RangeBegin(uint64_t range) { return range >> 32; }
+static uint32_t RangeEnd(uint64_t range) { return (uint32_t) range; }
+
+struct FarmWorker {
+  struct Farm *farm;
+  size_t id;
+  pthread_t thread;
+  // [begin, end) indices of roms this worker hasn't started yet. the owner
+  // takes roms from the front, idle workers steal half from the back
+  _Atomic uint64_t range;
+};
+
+struct Farm {
+  FarmItemFn job;
+  void *ctx;
+
+  size_t num_workers;
+  struct FarmWorker *workers;
+
+  pthread_mutex_t output_lock;
+};
+
+static bool TakeOwnWork(struct FarmWorker *w, uint32_t *index) {
+  uint64_t range = atomic_load(&w->range);
+  while (RangeBegin(range) < RangeEnd(range)) {
+    uint64_t rest = PackRange(RangeBegin(range) + 1, RangeEnd(range));
+    if (atomic_compare_exchange_weak(&w->range, &range, rest)) {
+      *index = RangeBegin(range);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool StealWork(struct FarmWorker *w, uint32_t *index) {
+  struct Farm *farm = w->farm;
+  for (size_t i = 1; i < farm->num_workers; i++) {
+    struct FarmWorker *victim = &farm->workers[(w->id + i) % farm->num_workers];
+
+    uint64_t range = atomic_load(&victim->range);
+    while (RangeBegin(range) < RangeEnd(range)) {
+      // leave the victim the front half, rounding in the victim's favour so a
+      // single remaining rom gets stolen instead of spinning on it
+      uint32_t begin = RangeBegin(range), end = RangeEnd(range);
+      uint32_t mid = begin + (end - begin) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &range,
+          PackRange(begin, mid))) {
+        // nobody steals from an empty range, so a plain store can't race
+        atomic_store(&w->range, PackRange(mid + 1, end));
+        *index = mid;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void *FarmWorkerMain(void *arg) {
+  struct FarmWorker *w = arg;
+  struct Farm *farm = w->farm;
+  char *line = malloc(kFarmMaxLineLen);
+  Assume(line);
+
+  uint32_t index;
+  while (TakeOwnWork(w, &index) || StealWork(w, &index)) {
+    size_t n = farm->job(index, farm->ctx, line);
+    assert(n <= kFarmMaxLineLen);
+
+    pthread_mutex_lock(&farm->output_lock);
+    fwrite(line, 1, n, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&farm->output_lock);
+  }
+
+  free(line);
+  return NULL;
+}
+
+void RunFarmItems(size_t count, size_t num_threads, FarmItemFn job,
+    void *ctx) {
+  assert(count <= UINT32_MAX);
+  if (num_threads == 0) num_threads = 1;
+
+  struct Farm farm = {
+    .job = job,
+    .ctx = ctx,
+    .num_workers = num_threads,
+    .workers = calloc(num_threads, sizeof(struct FarmWorker)),
+  };
+  Assume(farm.workers);
+  Assume(pthread_mutex_init(&farm.output_lock, NULL) == 0);
+
+  // start every worker off with an even contiguous share, stealing evens out
+  // the difference in how long each rom takes
+  for (size_t i = 0; i < num_threads; i++) {
+    struct FarmWorker *w = &farm.workers[i];
+    w->farm = &farm;
+    w->id = i;
+    atomic_init(&w->range, PackRange(count * i / num_threads,
+      count * (i + 1) / num_threads));
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    errno = pthread_create(&farm.workers[i].thread, NULL, FarmWorkerMain,
+      &farm.workers[i]);
+    Assume(errno == 0);
+  }
+
+  for (size_t i = 0; i < num_threads; i++)
+    pthread_join(farm.workers[i].thread, NULL);
+
+  pthread_mutex_destroy(&farm.output_lock);
+  free(farm.workers);
+}
+
+struct PathJob {
+  char **paths;
+  FarmJobFn job;
+  void *ctx;
+};
+
+static size_t RunPathJob(size_t index, void *ctx, char *line) {
+  struct PathJob *path_job = ctx;
+  return path_job->job(path_job->paths[index], path_job->ctx, line);
+}
+
+void RunFarm(char **paths, size_t count, size_t num_threads, FarmJobFn job,
+    void *ctx) {
+  struct PathJob path_job = {.paths = paths, .job = job, .ctx = ctx};
+  RunFarmItems(count, num_threads, RunPathJob, &path_job);
+}
+
+// ends a line that snprintf said would take n chars with a newline,
+// truncating it to fit
+static size_t EndLine(char *line, int n) {
+  assert(n >= 0);
+  if (n > kFarmMaxLineLen - 1) n = kFarmMaxLineLen - 1;
+  line[n] = '\n';
+  return n + 1;
+}
+
+size_t FarmFinishLine(char *line, int n) {
+  assert(n > 0);
+  // the newline snprintf wrote is either in place or truncated away
+  return EndLine(line, n - 1);
+}
+
+// runs vm and writes the result line for it, without the newline, returning
+// its length as snprintf does
+static int ReportRun(char *line, const char *name, int name_len,
+    struct VM *vm, uint64_t max_steps, uint64_t *steps) {
+  *steps = ExecuteRun(vm, max_steps);
+
+  const char *status = "limit";
+  if (vm->err)
+    status = "error";
+  else if (vm->brk_dir == vm->direction)
+    status = "brk";
+
+  // four hex digits and a tab per register
+  char regs[16 * 5 + 1];
+  for (int i = 0; i < 16; i++) {
+    snprintf(regs + i * 5, 6, "%04X\t", vm->reg[i]);
+  }
+
+  return snprintf(line, kFarmMaxLineLen, "%.*s\t%s\t%" PRIu64 "\t%04X\t%s%u\t%s",
+    name_len, name, status, *steps, vm->pc, regs, vm->err,
+    kErrorStrings[vm->err]);
+}
+
+size_t FarmRunRom(const char *path, void *ctx, char *line) {
+  uint64_t max_steps = *(uint64_t *) ctx;
+
+  struct VM *vm = RomCreateVM(path);
+  if (!vm) {
+    return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen, "%s\tload\t%s\n",
+      path, strerror(errno)));
+  }
+
+  uint64_t steps;
+  int n = ReportRun(line, path, strlen(path), vm, max_steps, &steps);
+  VMDestroy(vm);
+  return EndLine(line, n);
+}
+
+int FarmEntryName(const char *path, size_t index, const struct CorpusEntry *e,
+    char *buf, const char **name) {
+  if (e->flags & kCorpusHasName) {
+    *name = e->name;
+    return e->name_len < kFarmMaxLineLen ? e->name_len : kFarmMaxLineLen;
+  }
+  *name = buf;
+  return snprintf(buf, kFarmMaxLineLen, "%s:%zu", path, index);
+}
+
+size_t FarmRunCorpusEntry(size_t index, void *ctx_ptr, char *line) {
+  struct FarmCorpusCtx *ctx = ctx_ptr;
+
+  struct CorpusEntry e;
+  if (!CorpusGet(ctx->corpus, index, &e)) {
+    atomic_fetch_add(&ctx->failures, 1);
+    return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen,
+      "%s:%zu\tload\t%s\n", ctx->path, index, strerror(errno)));
+  }
+
+  char buf[kFarmMaxLineLen];
+  const char *name;
+  int name_len = FarmEntryName(ctx->path, index, &e, buf, &name);
+
+  // an entry with a result is run as far as it was when the result was
+  // recorded, so that it can match
+  uint64_t max_steps = ctx->max_steps;
+  if (e.flags & kCorpusHasResult)
+    max_steps = e.result_max_steps;
+
+  struct VM *vm = CorpusCreateVM(&e);
+  uint64_t steps;
+  int n = ReportRun(line, name, name_len, vm, max_steps, &steps);
+  if (e.flags & kCorpusHasResult && n < kFarmMaxLineLen) {
+    bool match = CorpusMatchesResult(&e, vm, steps);
+    if (!match) atomic_fetch_add(&ctx->failures, 1);
+    n += snprintf(line + n, kFarmMaxLineLen - n, "\t%s",
+      match ? "match" : "mismatch");
+  }
+  VMDestroy(vm);
+  return EndLine(line, n);
+}
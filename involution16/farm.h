@@ -0,0 +1,70 @@
+#ifndef FARM_H_
+#define FARM_H_
+
+#include "corpus.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  // longest result line a job may produce, including the newline
+  kFarmMaxLineLen = 8192,
+};
+
+// called once per rom on a worker thread. writes a newline terminated result
+// of at most kFarmMaxLineLen chars into line and returns its length
+typedef size_t (*FarmJobFn)(const char *path, void *ctx, char *line);
+// as FarmJobFn, for work that's numbered instead of named by a path
+typedef size_t (*FarmItemFn)(size_t index, void *ctx, char *line);
+
+// reads the list of roms at path, which is either a directory, where every
+// regular file is a rom, or a manifest listing one rom path per line. blank
+// lines and lines starting with '#' in a manifest are skipped. returns NULL
+// with errno set on failure
+char **FarmCollectRoms(const char *path, size_t *count);
+
+// runs job on every rom across num_threads threads and writes each result line
+// to stdout as soon as it's ready, so results are not in input order
+void RunFarm(char **paths, size_t count, size_t num_threads, FarmJobFn job,
+  void *ctx);
+// as RunFarm, for items 0 through count - 1. every thread starts on its own
+// contiguous run of items and works through it in order
+void RunFarmItems(size_t count, size_t num_threads, FarmItemFn job,
+  void *ctx);
+
+// turns the return value of an snprintf of a result line into its length,
+// keeping the newline at the end of truncated lines
+size_t FarmFinishLine(char *line, int n);
+
+// job that executes a rom to a brk, an error, or *(uint64_t *) ctx steps and
+// reports the final state as tab separated fields:
+//   path, status (brk, error, or limit), steps, pc, r0 through rF, error code,
+//   error string
+// roms that fail to load are reported as just path, "load", and the reason
+size_t FarmRunRom(const char *path, void *ctx, char *line);
+
+// points name at the name of entry index of the corpus at path and returns
+// its length. entries without a name of their own are named "path:index",
+// written to buf, which has space for kFarmMaxLineLen chars
+int FarmEntryName(const char *path, size_t index, const struct CorpusEntry *,
+  char *buf, const char **name);
+
+struct FarmCorpusCtx {
+  const struct CorpusReader *corpus;
+  // names entries without a name of their own
+  const char *path;
+  uint64_t max_steps;
+  // incremented for every entry that is corrupt or doesn't end as expected
+  _Atomic size_t failures;
+};
+
+// FarmItemFn taking a struct FarmCorpusCtx, runs an entry of a corpus from
+// its start state and reports it as FarmRunRom does, named as by
+// FarmEntryName. entries with an expected result are run to the step bound
+// stored with it instead of max_steps, and get a final field, match or
+// mismatch. corrupt entries are reported as just the name,
+// "load", and the reason
+size_t FarmRunCorpusEntry(size_t index, void *ctx, char *line);
+
+#endif
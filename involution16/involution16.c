@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 
 static void Assume(bool cond) {
@@ -15,7 +16,7 @@ static void Assume(bool cond) {
 
 uint32_t Ror32(uint32_t x, uint8_t n) {
   assert(n < 32);
-  return (x >> n) | (x << (32 - n));
+  return (x >> n) | (x << (-n & 31));
 }
 
 uint32_t Rol32(uint32_t x, uint8_t n) {
@@ -51,38 +52,360 @@ const uint8_t kSrrCodes[][4] = {
   {2, 1, 0, 3},
 };
 
+// superinstructions, numbered after the ops. each executes a common three
+// instruction idiom with a single dispatch, and keeps the values passed
+// between its instructions out of memory
+enum {
+  // add a, b, c; sub b, a, c; srr a, b, ctl adds c to b
+  kFuseAdd = 16,
+  // mul a, b, c; div c, a, b; srr c, a, ctl multiplies c by b
+  kFuseMul,
+  // xri a, label; cmp b, c, d; jeq a, b, e jumps to label depending on how c
+  // compares to d
+  kFuseJump,
+};
+
+// every VM starts out with all of its memory pointing at this page. it has no
+// reference count, so it is never freed and always gets copied before a write
+static struct VMPage fill_page = {
+  .refs = 0,
+  .stamp = 0,
+  .bytes = {[0 ... kVMPageSize - 1] = (kOpBrk << 4) | 0xF},
+  .decoded = {[0 ... kVMPageSlots - 1] = {kOpBrk, 0xF, 0xF, 0xF}},
+  .dispatch = {[0 ... kVMPageSlots - 1] = kOpBrk},
+};
+
+// page stamps, 0 belongs to the fill page
+static _Atomic uint64_t next_stamp = 1;
+
+static uint64_t NewStamp(void) {
+  return atomic_fetch_add_explicit(&next_stamp, 1, memory_order_relaxed);
+}
+
+static struct VMPage *PageRef(struct VMPage *page) {
+  if (page != &fill_page)
+    atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+  return page;
+}
+
+static void PageUnref(struct VMPage *page) {
+  if (page == &fill_page) return;
+  if (atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1)
+    free(page);
+}
+
+// returns page i of the vm's memory, first giving the vm its own copy if the
+// page is shared with anything else
+static struct VMPage *PageMakeWritable(struct VM *vm, size_t i) {
+  struct VMPage *page = vm->pages[i];
+  if (page != &fill_page &&
+      atomic_load_explicit(&page->refs, memory_order_acquire) == 1)
+    return page;
+
+  struct VMPage *copy = malloc(sizeof(*copy));
+  Assume(copy);
+  atomic_init(&copy->refs, 1);
+  copy->stamp = page->stamp;
+  memcpy(copy->bytes, page->bytes, sizeof(copy->bytes));
+  memcpy(copy->decoded, page->decoded, sizeof(copy->decoded));
+  memcpy(copy->dispatch, page->dispatch, sizeof(copy->dispatch));
+
+  PageUnref(page);
+  vm->pages[i] = copy;
+  return copy;
+}
+
+// the superinstruction starting at slot i of page, or its op if there's none.
+// the registers have to line up exactly as in the idiom, which rules out any
+// aliasing the fused handlers don't account for
+static uint8_t FuseSlot(const struct VMPage *page, size_t i) {
+  const struct DecodedInsn *seq = page->decoded + i;
+  if (i + 3 > kVMPageSlots) return seq[0].op;
+  struct DecodedInsn a = seq[0], b = seq[1], c = seq[2];
+
+  // an srr with an invalid control raises an error, and the unfused
+  // instructions take care of that
+  bool srr = c.op == kOpSrr && c.z < kSrrCodeCount;
+  bool distinct = a.x != a.y && a.x != a.z && a.y != a.z;
+  if (a.op == kOpAdd && b.op == kOpSub && srr && distinct &&
+      b.x == a.y && b.y == a.x && b.z == a.z && c.x == a.x && c.y == a.y)
+    return kFuseAdd;
+  if (a.op == kOpMul && b.op == kOpDiv && srr && distinct &&
+      b.x == a.z && b.y == a.x && b.z == a.y && c.x == a.z && c.y == a.x)
+    return kFuseMul;
+  if (a.op == kOpXri && b.op == kOpCmp && c.op == kOpJeq &&
+      b.x != a.x && b.y != a.x && b.z != a.x && c.x == a.x && c.y == b.x)
+    return kFuseJump;
+  return a.op;
+}
+
+static void DecodeSlots(struct VMPage *page, size_t first, size_t count) {
+  for (size_t i = first; i < first + count; i++) {
+    const uint8_t *insn = page->bytes + i * 2;
+    page->decoded[i] = (struct DecodedInsn) {
+      insn[0] >> 4,
+      insn[0] & 0xF,
+      insn[1] >> 4,
+      insn[1] & 0xF
+    };
+  }
+
+  // superinstructions starting up to two slots before first include the
+  // slots that changed
+  for (size_t i = first < 2 ? 0 : first - 2; i < first + count; i++)
+    page->dispatch[i] = FuseSlot(page, i);
+}
+
+// the splitmix64 finalizer
+static uint64_t Mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EB;
+  return x ^ x >> 31;
+}
+
+// the term of byte at addr in the memory hash. xoring terms makes the hash
+// of memory zobrist hashing, where a write replaces one term with another
+static void HashByte(struct VMHash *h, uint16_t addr, uint8_t byte) {
+  uint64_t key = (uint64_t) addr << 8 | byte;
+  h->lo ^= Mix64(key ^ 0x9E3779B97F4A7C15);
+  h->hi ^= Mix64(key ^ 0xC2B2AE3D27D4EB4F);
+}
+
+static void HashWrite(struct VM *vm, uint16_t addr, uint8_t old_byte,
+    uint8_t new_byte) {
+  if (!vm->mem_hash_valid || old_byte == new_byte) return;
+  HashByte(&vm->mem_hash, addr, old_byte);
+  HashByte(&vm->mem_hash, addr, new_byte);
+}
+
 struct VM *VMCreate(void) {
   struct VM *vm = malloc(sizeof(*vm));
   Assume(vm);
+  for (size_t i = 0; i < kVMPageCount; i++)
+    vm->pages[i] = &fill_page;
+  VMReset(vm);
+  vm->step_hook = NULL;
+  vm->step_hook_ctx = NULL;
+  vm->step_log = NULL;
+  vm->step_log_ctx = NULL;
+
+  return vm;
+}
+
+void VMDestroy(struct VM *vm) {
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageUnref(vm->pages[i]);
+  free(vm);
+}
+
+void VMReset(struct VM *vm) {
+  for (size_t i = 0; i < kVMPageCount; i++) {
+    PageUnref(vm->pages[i]);
+    vm->pages[i] = &fill_page;
+  }
   memset(vm->reg, 0, sizeof(vm->reg));
-  memset(vm->memory, (kOpBrk << 4) | 0xF, sizeof(vm->memory));
   vm->pc = 0;
   vm->direction = kExecutingForward;
+  vm->brk_dir = 0;
   vm->err = kErrorNone;
+  vm->mem_hash_valid = false;
+}
 
-  return vm;
+struct VM *VMFork(const struct VM *vm) {
+  struct VM *fork = malloc(sizeof(*fork));
+  Assume(fork);
+  *fork = *vm;
+  fork->step_hook = NULL;
+  fork->step_hook_ctx = NULL;
+  fork->step_log = NULL;
+  fork->step_log_ctx = NULL;
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageRef(fork->pages[i]);
+
+  return fork;
 }
 
-void ExecuteStep(struct VM *vm) {
-  if (vm->brk_dir == vm->direction) return;
+struct VMSnapshot *VMSnapshot(const struct VM *vm) {
+  struct VMSnapshot *snap = malloc(sizeof(*snap));
+  Assume(snap);
+  snap->state = *vm;
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageRef(snap->state.pages[i]);
+
+  return snap;
+}
+
+void VMSnapshotDestroy(struct VMSnapshot *snap) {
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageUnref(snap->state.pages[i]);
+  free(snap);
+}
+
+void VMRestore(struct VM *vm, const struct VMSnapshot *snap) {
+  // take the new references first in case vm and snap share pages
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageRef(snap->state.pages[i]);
+  for (size_t i = 0; i < kVMPageCount; i++)
+    PageUnref(vm->pages[i]);
+
+  StepHook hook = vm->step_hook;
+  void *hook_ctx = vm->step_hook_ctx;
+  StepLog log = vm->step_log;
+  void *log_ctx = vm->step_log_ctx;
+  *vm = snap->state;
+  vm->step_hook = hook;
+  vm->step_hook_ctx = hook_ctx;
+  vm->step_log = log;
+  vm->step_log_ctx = log_ctx;
+}
+
+uint8_t VMReadByte(const struct VM *vm, uint16_t addr) {
+  return vm->pages[addr / kVMPageSize]->bytes[addr % kVMPageSize];
+}
+
+void VMReadMemory(const struct VM *vm, uint16_t addr, void *dst, size_t len) {
+  assert(addr + len <= 65536);
+  uint8_t *out = dst;
+  while (len > 0) {
+    size_t offset = addr % kVMPageSize;
+    size_t n = kVMPageSize - offset;
+    if (n > len) n = len;
+
+    memcpy(out, vm->pages[addr / kVMPageSize]->bytes + offset, n);
+    out += n;
+    addr += n;
+    len -= n;
+  }
+}
+
+void VMWriteMemory(struct VM *vm, uint16_t addr, const void *src, size_t len) {
+  assert(addr + len <= 65536);
+  const uint8_t *in = src;
+  while (len > 0) {
+    size_t offset = addr % kVMPageSize;
+    size_t n = kVMPageSize - offset;
+    if (n > len) n = len;
+
+    struct VMPage *page = PageMakeWritable(vm, addr / kVMPageSize);
+    if (vm->mem_hash_valid) {
+      for (size_t i = 0; i < n; i++)
+        HashWrite(vm, addr + i, page->bytes[offset + i], in[i]);
+    }
+    memcpy(page->bytes + offset, in, n);
+    page->stamp = NewStamp();
+    DecodeSlots(page, offset / 2, (offset + n + 1) / 2 - offset / 2);
+
+    in += n;
+    addr += n;
+    len -= n;
+  }
+}
+
+struct VMHash VMMemoryHash(struct VM *vm) {
+  if (!vm->mem_hash_valid) {
+    vm->mem_hash = (struct VMHash) {0};
+    for (uint32_t addr = 0; addr < 65536; addr++)
+      HashByte(&vm->mem_hash, addr, VMReadByte(vm, addr));
+    vm->mem_hash_valid = true;
+  }
+  return vm->mem_hash;
+}
+
+struct VMHash VMStateHash(struct VM *vm) {
+  struct VMHash h = VMMemoryHash(vm);
+
+  // the rest of the state packed into words in an order that doesn't depend
+  // on the machine's byte order
+  uint64_t words[5];
+  for (int i = 0; i < 4; i++) {
+    words[i] = 0;
+    for (int j = 0; j < 4; j++)
+      words[i] |= (uint64_t) vm->reg[i * 4 + j] << j * 16;
+  }
+  words[4] = vm->pc | (uint64_t) (uint8_t) vm->direction << 16 |
+    (uint64_t) (uint8_t) vm->brk_dir << 24 | (uint64_t) vm->err << 32;
+
+  for (int i = 0; i < 5; i++) {
+    h.lo = Mix64(h.lo ^ words[i]);
+    h.hi = Mix64(h.hi + words[i] * 0x9E3779B97F4A7C15);
+  }
+  return h;
+}
+
+// returns the two bytes of the aligned instruction at addr
+static const uint8_t *InsnBytes(const struct VM *vm, uint16_t addr) {
+  return vm->pages[addr / kVMPageSize]->bytes + addr % kVMPageSize;
+}
+
+static struct DecodedInsn Fetch(const struct VM *vm, uint16_t addr) {
+  return vm->pages[addr / kVMPageSize]->decoded[addr % kVMPageSize / 2];
+}
+
+// ctl must be less than kSrrCodeCount
+static void PermuteRegs(uint16_t *x, uint16_t *y, uint8_t ctl) {
+  uint8_t bytes[4], bytes_new[4];
+  memcpy(bytes, x, 2);
+  memcpy(bytes + 2, y, 2);
+
+  const uint8_t *perm = kSrrCodes[ctl];
+  for (int i = 0; i < 4; i++) {
+    bytes_new[i] = bytes[perm[i]];
+  }
+
+  memcpy(x, bytes_new, 2);
+  memcpy(y, bytes_new + 2, 2);
+}
+
+// swaps the register x with the two bytes of memory at addr
+static void SwapMemory(struct VM *vm, uint16_t addr, uint16_t *x) {
+  // the address may be unaligned, so the two bytes can land in different
+  // slots, and the second byte wraps around at the end of memory
+  uint16_t addrs[2] = {addr, addr + 1};
+  uint8_t bytes_old[2] = {VMReadByte(vm, addrs[0]), VMReadByte(vm, addrs[1])};
+  uint8_t bytes_new[2];
+  memcpy(bytes_new, x, 2);
+  memcpy(x, bytes_old, 2);
+  for (int i = 0; i < 2; i++) {
+    size_t offset = addrs[i] % kVMPageSize;
+    struct VMPage *page = PageMakeWritable(vm, addrs[i] / kVMPageSize);
+    HashWrite(vm, addrs[i], bytes_old[i], bytes_new[i]);
+    page->bytes[offset] = bytes_new[i];
+    page->stamp = NewStamp();
+    DecodeSlots(page, offset / 2, 1);
+  }
+}
+
+// executes a single step, describing it in info. returns false if no step was
+// taken, because the VM is stopped at a brk or the instruction raised an error
+static inline bool Step(struct VM *vm, struct StepInfo *info) {
+  if (vm->brk_dir == vm->direction) return false;
+
+  *info = (struct StepInfo) {
+    .kind = kStepInsn,
+    .direction = vm->direction,
+    .pc_before = vm->pc,
+  };
 
   if (vm->brk_dir) {
     vm->pc += sizeof(uint16_t) * vm->direction;
     vm->brk_dir = 0;
-    return;
+    info->kind = kStepLeaveBrk;
+    info->pc_after = vm->pc;
+    return true;
   }
 
   if (vm->direction == kExecutingBackward)
     vm->pc += sizeof(uint16_t) * vm->direction;
 
-  uint8_t insn[2];
-  memcpy(&insn, vm->memory + vm->pc, sizeof(insn));
-  uint8_t field[4] = {
-    insn[0] >> 4,
-    insn[0] & 0xF,
-    insn[1] >> 4,
-    insn[1] & 0xF
-  };
+  struct DecodedInsn insn = Fetch(vm, vm->pc);
+  uint8_t field[4] = {insn.op, insn.x, insn.y, insn.z};
+
+  info->insn_addr = vm->pc;
+  info->insn = insn;
+  info->x_old = vm->reg[insn.x];
+  info->y_old = vm->reg[insn.y];
 
   switch (field[0]) {
     case kOpAdd:
@@ -133,48 +456,35 @@ void ExecuteStep(struct VM *vm) {
         uint16_t target = vm->reg[field[1]];
         if (target & 1) {
           vm->err = kErrorMisalignedJump;
-          return;
+          return false;
         }
 
-        if (memcmp(vm->memory + vm->pc, vm->memory + target, 2) != 0) {
+        if (memcmp(InsnBytes(vm, vm->pc), InsnBytes(vm, target), 2) != 0) {
           vm->err = kErrorMismatchedJump;
-          return;
+          return false;
         }
         vm->reg[field[1]] = vm->pc;
         vm->pc = target;
+        info->taken = true;
       }
       break;
     }
     case kOpXri: {
-      vm->reg[field[1]] ^= insn[1];
+      vm->reg[field[1]] ^= (field[2] << 4) | field[3];
       break;
     }
     case kOpSrr: {
       uint16_t ctl = field[3];
       if (ctl >= kSrrCodeCount) {
         vm->err = kErrorInvalidSrrEncoding;
-        return;
+        return false;
       }
 
-      uint8_t bytes[4], bytes_new[4];
-      memcpy(bytes, &vm->reg[field[1]], 2);
-      memcpy(bytes + 2, &vm->reg[field[2]], 2);
-
-      const uint8_t *perm = kSrrCodes[ctl];
-      for (int i = 0; i < 4; i++) {
-        bytes_new[i] = bytes[perm[i]];
-      }
-
-      memcpy(&vm->reg[field[1]], bytes_new, 2);
-      memcpy(&vm->reg[field[2]], bytes_new + 2, 2);
-
+      PermuteRegs(&vm->reg[field[1]], &vm->reg[field[2]], ctl);
       break;
     }
     case kOpSrm: {
-      uint16_t tmp;
-      memcpy(&tmp, vm->memory + vm->reg[field[2]], 2);
-      memcpy(vm->memory + vm->reg[field[2]], &vm->reg[field[1]], 2);
-      vm->reg[field[1]] = tmp;
+      SwapMemory(vm, vm->reg[field[2]], &vm->reg[field[1]]);
       break;
     }
     case kOpBrk:
@@ -185,4 +495,697 @@ void ExecuteStep(struct VM *vm) {
   if (vm->direction == kExecutingForward) {
     vm->pc += sizeof(uint16_t) * vm->direction;
   }
-}
\ No newline at end of file
+
+  info->pc_after = vm->pc;
+  info->x_new = vm->reg[insn.x];
+  info->y_new = vm->reg[insn.y];
+  return true;
+}
+
+// writes the record of a step with the given flags and deltas to p, which
+// needs room for eight bytes, and returns its end
+static inline uint8_t *PutStepRecord(uint8_t *p, uint8_t flags, uint16_t dx,
+    uint16_t dy) {
+  // the record is assembled in a word and stored in one go, a y delta of
+  // zero being left past the end. like PermuteRegs, this takes the host to
+  // be little endian. the x delta is always there so that where the next
+  // record goes rarely waits on this one's results
+  uint64_t word = flags | (dy != 0) * kStepRecordY | (uint64_t) dx << 8 |
+    (uint64_t) dy << 24;
+  memcpy(p, &word, sizeof(word));
+  return p + 3 + (dy != 0) * 2;
+}
+
+void ExecuteStep(struct VM *vm) {
+  struct StepRecords records = {.pc_before = vm->pc};
+  if (vm->step_log) {
+    memcpy(records.reg_before, vm->reg, sizeof(records.reg_before));
+    vm->step_log(vm, &records, vm->step_log_ctx);
+  }
+
+  struct StepInfo info;
+  if (!Step(vm, &info)) return;
+  if (vm->step_hook)
+    vm->step_hook(vm, &info, 1, vm->step_hook_ctx);
+  if (vm->step_log) {
+    uint8_t record[8];
+    uint8_t flags = info.direction == kExecutingBackward ?
+      kStepRecordBackward : 0;
+    if (info.kind == kStepLeaveBrk) {
+      record[0] = flags | kStepRecordLeaveBrk;
+      records.len = 1;
+    } else {
+      uint16_t dy = info.insn.y != info.insn.x ? info.y_old ^ info.y_new : 0;
+      records.len = PutStepRecord(record, flags, info.x_old ^ info.x_new,
+        dy) - record;
+    }
+    records.pc_after = info.pc_after;
+    records.count = 1;
+    records.data = record;
+    vm->step_log(vm, &records, vm->step_log_ctx);
+  }
+}
+
+// whether stops picks out insn, the instruction at addr
+static inline bool StopsBefore(const struct VMStops *stops, uint16_t addr,
+    struct DecodedInsn insn) {
+  if (stops->breakpoints && stops->breakpoints[addr / 64] >> (addr % 64) & 1)
+    return true;
+
+  uint16_t writes = insn.op == kOpBrk ? 0 : 1 << insn.x;
+  if (insn.op == kOpSrr)
+    writes |= 1 << insn.y;
+  return writes & stops->regs || (insn.op == kOpSrm && stops->mem);
+}
+
+// Run while the VM has a step hook or a step log. this is a copy of Run's
+// loop in which every op also writes the record of its step, kept apart so
+// that the plain loop has the registers to itself
+static uint64_t RunRecorded(struct VM *vm, uint64_t max_steps,
+    const struct VMStops *stops) {
+  uint64_t steps = 0;
+  if (vm->brk_dir) {
+    // stepping off of a brk takes a step of its own, which ExecuteStep
+    // reports
+    ExecuteStep(vm);
+    steps++;
+  }
+
+#define OP_HANDLERS \
+    [kOpAdd] = &&op_add, \
+    [kOpSub] = &&op_sub, \
+    [kOpRor] = &&op_ror, \
+    [kOpRol] = &&op_rol, \
+    [kOpShr] = &&op_shr, \
+    [kOpShl] = &&op_shl, \
+    [kOpAnd] = &&op_and, \
+    [kOpOra] = &&op_ora, \
+    [kOpMul] = &&op_mul, \
+    [kOpDiv] = &&op_div, \
+    [kOpCmp] = &&op_cmp, \
+    [kOpJeq] = &&op_jeq, \
+    [kOpXri] = &&op_xri, \
+    [kOpSrr] = &&op_srr, \
+    [kOpSrm] = &&op_srm, \
+    [kOpBrk] = &&op_brk
+
+  // indexed by VMPage.dispatch, as in Run. with a step hook or stops, every
+  // op goes through a check for it first, which goes on to the op's handler
+  static const void *const kForwardHandlers[] = {
+    OP_HANDLERS,
+    [kFuseAdd] = &&fuse_add,
+    [kFuseMul] = &&fuse_mul,
+    [kFuseJump] = &&fuse_jump,
+  };
+  static const void *const kBackwardHandlers[] = {
+    OP_HANDLERS,
+    [kFuseAdd] = &&op_add,
+    [kFuseMul] = &&op_mul,
+    [kFuseJump] = &&op_xri,
+  };
+  static const void *const kCheckedHandlers[] = {
+    [kOpAdd] = &&check_add,
+    [kOpSub] = &&check_sub,
+    [kOpRor] = &&check_ror,
+    [kOpRol] = &&check_rol,
+    [kOpShr] = &&check_shr,
+    [kOpShl] = &&check_shl,
+    [kOpAnd] = &&check_and,
+    [kOpOra] = &&check_ora,
+    [kOpMul] = &&check_mul,
+    [kOpDiv] = &&check_div,
+    [kOpCmp] = &&check_cmp,
+    [kOpJeq] = &&check_jeq,
+    [kOpXri] = &&check_xri,
+    [kOpSrr] = &&check_srr,
+    [kOpSrm] = &&check_srm,
+    [kOpBrk] = &&check_brk,
+    [kFuseAdd] = &&check_add,
+    [kFuseMul] = &&check_mul,
+    [kFuseJump] = &&check_xri,
+  };
+
+#undef OP_HANDLERS
+
+  uint16_t reg[16];
+  memcpy(reg, vm->reg, sizeof(reg));
+  uint16_t pc = vm->pc;
+
+  const uint16_t pc_pre = vm->direction == kExecutingBackward ? -2 : 0;
+  const uint16_t pc_post = vm->direction == kExecutingForward ? 2 : 0;
+
+  const StepHook hook = vm->step_hook;
+  const StepLog log = vm->step_log;
+  const void *const *handlers = vm->direction == kExecutingForward ?
+    kForwardHandlers : kBackwardHandlers;
+  if (hook || stops)
+    handlers = kCheckedHandlers;
+
+  // for the hook, a step is recorded in batch before it executes and its
+  // results are filled in when the next one is dispatched, or on the way out.
+  // the batch goes to the hook whenever it fills up
+  const ExecutionDirection direction = vm->direction;
+  struct StepInfo batch[kStepBatch];
+  size_t batch_len = 0;
+  bool recording = false;
+
+  // records are written whether or not there's a log to take them, and go to
+  // it in batches that end at batch_end steps. a superinstruction runs only
+  // if all of its steps fit in the batch
+  const uint8_t log_flags = direction == kExecutingBackward ?
+    kStepRecordBackward : 0;
+  struct StepRecords records = {.pc_before = pc};
+  memcpy(records.reg_before, reg, sizeof(reg));
+  uint8_t log_data[kStepLogBatch * kStepRecordMaxLen + 8];
+  uint8_t *log_end = log_data;
+  uint64_t batch_start = steps;
+  uint64_t batch_end = max_steps - steps > kStepLogBatch ?
+    steps + kStepLogBatch : max_steps;
+
+  // the log hears of the run before its first step, while vm is the state
+  // before it
+  if (log)
+    log(vm, &records, vm->step_log_ctx);
+
+  struct VMPage *const *pages = vm->pages;
+  const struct VMPage *page;
+  struct DecodedInsn insn;
+
+#define DISPATCH() \
+  do { \
+    if (steps >= batch_end) goto batch_done; \
+    pc += pc_pre; \
+    page = pages[pc / kVMPageSize]; \
+    insn = page->decoded[pc % kVMPageSize / 2]; \
+    goto *handlers[page->dispatch[pc % kVMPageSize / 2]]; \
+  } while (0)
+
+#define NEXT() \
+  do { \
+    pc += pc_post; \
+    steps++; \
+    DISPATCH(); \
+  } while (0)
+
+#define LOG(dx, dy) (log_end = PutStepRecord(log_end, log_flags, dx, dy))
+
+// an op that xors value into its x register
+#define ALU(value) \
+  do { \
+    uint16_t d = (value); \
+    reg[insn.x] ^= d; \
+    LOG(d, 0); \
+    NEXT(); \
+  } while (0)
+
+  DISPATCH();
+
+batch_done:
+  if (steps == max_steps) goto out;
+  if (log) {
+    memcpy(vm->reg, reg, sizeof(reg));
+    vm->pc = pc;
+    records.pc_after = pc;
+    records.data = log_data;
+    records.len = log_end - log_data;
+    records.count = steps - batch_start;
+    log(vm, &records, vm->step_log_ctx);
+    records.pc_before = pc;
+    memcpy(records.reg_before, reg, sizeof(reg));
+  }
+  log_end = log_data;
+  batch_start = steps;
+  batch_end = max_steps - steps > kStepLogBatch ?
+    steps + kStepLogBatch : max_steps;
+  DISPATCH();
+
+  // finishes the step recorded before the last one executed and records the
+  // next, unless stops picks it out. there's a copy of this for every op, so
+  // that each keeps a dispatch branch of its own
+#define CHECK(name) \
+  check_##name: \
+    if (recording) { \
+      struct StepInfo *info = &batch[batch_len++]; \
+      info->pc_after = pc - pc_pre; \
+      info->x_new = reg[info->insn.x]; \
+      info->y_new = reg[info->insn.y]; \
+      recording = false; \
+      if (batch_len == kStepBatch) { \
+        memcpy(vm->reg, reg, sizeof(reg)); \
+        vm->pc = pc - pc_pre; \
+        hook(vm, batch, batch_len, vm->step_hook_ctx); \
+        batch_len = 0; \
+      } \
+    } \
+    if (stops && StopsBefore(stops, pc, insn)) { \
+      pc -= pc_pre; \
+      goto out; \
+    } \
+    if (hook) { \
+      struct StepInfo *info = &batch[batch_len]; \
+      info->kind = kStepInsn; \
+      info->direction = direction; \
+      info->pc_before = pc - pc_pre; \
+      info->insn_addr = pc; \
+      info->insn = insn; \
+      info->x_old = reg[insn.x]; \
+      info->y_old = reg[insn.y]; \
+      info->taken = insn.op == kOpJeq && reg[insn.y] == reg[insn.z]; \
+      recording = true; \
+    } \
+    goto op_##name;
+
+  CHECK(add)
+  CHECK(sub)
+  CHECK(ror)
+  CHECK(rol)
+  CHECK(shr)
+  CHECK(shl)
+  CHECK(and)
+  CHECK(ora)
+  CHECK(mul)
+  CHECK(div)
+  CHECK(cmp)
+  CHECK(jeq)
+  CHECK(xri)
+  CHECK(srr)
+  CHECK(srm)
+  CHECK(brk)
+
+#undef CHECK
+
+op_add:
+  ALU(reg[insn.y] + reg[insn.z]);
+op_sub:
+  ALU(reg[insn.y] - reg[insn.z]);
+op_ror:
+  ALU(Ror32(reg[insn.y], reg[insn.z] & 0xF));
+op_rol:
+  ALU(Rol32(reg[insn.y], reg[insn.z] & 0xF));
+op_shr:
+  ALU(reg[insn.y] >> (reg[insn.z] & 0xF));
+op_shl:
+  ALU(reg[insn.y] << (reg[insn.z] & 0xF));
+op_and:
+  ALU(reg[insn.y] & reg[insn.z]);
+op_ora:
+  ALU(reg[insn.y] | reg[insn.z]);
+op_mul:
+  ALU((unsigned) reg[insn.y] * reg[insn.z]);
+op_div:
+  ALU(reg[insn.z] != 0 ? reg[insn.y] / reg[insn.z] : 0);
+op_cmp: {
+  uint16_t a = reg[insn.y];
+  uint16_t b = reg[insn.z];
+  ALU((a > b) - (a < b));
+}
+op_jeq:
+  if (reg[insn.y] == reg[insn.z]) {
+    uint16_t target = reg[insn.x];
+    if (target & 1) {
+      vm->err = kErrorMisalignedJump;
+      goto out;
+    }
+
+    if (memcmp(InsnBytes(vm, pc), InsnBytes(vm, target), 2) != 0) {
+      vm->err = kErrorMismatchedJump;
+      goto out;
+    }
+    reg[insn.x] = pc;
+    pc = target;
+    LOG(target ^ reg[insn.x], 0);
+  } else {
+    LOG(0, 0);
+  }
+  NEXT();
+op_xri:
+  ALU((insn.y << 4) | insn.z);
+op_srr: {
+  if (insn.z >= kSrrCodeCount) {
+    vm->err = kErrorInvalidSrrEncoding;
+    goto out;
+  }
+  uint16_t x = reg[insn.x], y = reg[insn.y];
+  PermuteRegs(&reg[insn.x], &reg[insn.y], insn.z);
+  LOG(x ^ reg[insn.x], insn.y != insn.x ? y ^ reg[insn.y] : 0);
+  NEXT();
+}
+op_srm: {
+  uint16_t x = reg[insn.x];
+  SwapMemory(vm, reg[insn.y], &reg[insn.x]);
+  LOG(x ^ reg[insn.x], 0);
+  NEXT();
+}
+op_brk:
+  vm->brk_dir = vm->direction;
+  pc += pc_post;
+  steps++;
+  LOG(0, 0);
+  goto out;
+
+  // as in Run, also writing a record for each instruction. the registers line
+  // up as FuseSlot has them, so only the srrs change two
+fuse_add: {
+  if (batch_end - steps < 3) goto op_add;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t a = reg[insn.x], b = reg[insn.y], c = reg[insn.z];
+  uint16_t a0 = a, b0 = b;
+  a ^= b + c;
+  b ^= a - c;
+  uint16_t a1 = a, b1 = b;
+  PermuteRegs(&a, &b, seq[2].z);
+  LOG(a0 ^ a1, 0);
+  LOG(b0 ^ b1, 0);
+  LOG(a1 ^ a, b1 ^ b);
+  reg[insn.x] = a;
+  reg[insn.y] = b;
+  pc += 4;
+  steps += 2;
+  NEXT();
+}
+fuse_mul: {
+  if (batch_end - steps < 3) goto op_mul;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t a = reg[insn.x], b = reg[insn.y], c = reg[insn.z];
+  uint16_t a0 = a, c0 = c;
+  a ^= (unsigned) b * c;
+  if (b != 0)
+    c ^= a / b;
+  uint16_t a1 = a, c1 = c;
+  PermuteRegs(&c, &a, seq[2].z);
+  LOG(a0 ^ a1, 0);
+  LOG(c0 ^ c1, 0);
+  LOG(c1 ^ c, a1 ^ a);
+  reg[insn.x] = a;
+  reg[insn.z] = c;
+  pc += 4;
+  steps += 2;
+  NEXT();
+}
+fuse_jump: {
+  if (batch_end - steps < 3) goto op_xri;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t target = reg[insn.x] ^ ((insn.y << 4) | insn.z);
+  uint16_t a = reg[seq[1].y];
+  uint16_t b = reg[seq[1].z];
+  uint16_t flag = reg[seq[1].x] ^ (uint16_t) ((a > b) - (a < b));
+  LOG(reg[insn.x] ^ target, 0);
+  LOG(reg[seq[1].x] ^ flag, 0);
+  reg[insn.x] = target;
+  reg[seq[1].x] = flag;
+  pc += 4;
+  steps += 2;
+  // the jeq may compare the flag against itself or the target
+  if (flag == reg[seq[2].z]) {
+    if (target & 1) {
+      vm->err = kErrorMisalignedJump;
+      goto out;
+    }
+
+    if (memcmp(InsnBytes(vm, pc), InsnBytes(vm, target), 2) != 0) {
+      vm->err = kErrorMismatchedJump;
+      goto out;
+    }
+    reg[insn.x] = pc;
+    pc = target;
+    LOG(target ^ reg[insn.x], 0);
+  } else {
+    LOG(0, 0);
+  }
+  NEXT();
+}
+
+#undef ALU
+#undef LOG
+#undef NEXT
+#undef DISPATCH
+
+out:
+  memcpy(vm->reg, reg, sizeof(reg));
+  vm->pc = pc;
+  // an instruction that raised an error didn't retire
+  if (recording && !vm->err) {
+    struct StepInfo *info = &batch[batch_len++];
+    info->pc_after = pc;
+    info->x_new = reg[info->insn.x];
+    info->y_new = reg[info->insn.y];
+  }
+  if (batch_len > 0)
+    hook(vm, batch, batch_len, vm->step_hook_ctx);
+  if (log && steps > batch_start) {
+    // going backwards, pc has already moved onto the faulting instruction
+    records.pc_after = vm->err ? pc - pc_pre : pc;
+    records.data = log_data;
+    records.len = log_end - log_data;
+    records.count = steps - batch_start;
+    log(vm, &records, vm->step_log_ctx);
+  }
+  return steps;
+}
+
+// ExecuteRun, and ExecuteRunUntil if stops is set
+static uint64_t Run(struct VM *vm, uint64_t max_steps,
+    const struct VMStops *stops) {
+  if (vm->err || vm->brk_dir == vm->direction || max_steps == 0) return 0;
+
+  if (vm->step_hook || vm->step_log)
+    return RunRecorded(vm, max_steps, stops);
+
+  uint64_t steps = 0;
+  if (vm->brk_dir) {
+    // stepping off of a brk takes a step of its own
+    ExecuteStep(vm);
+    steps++;
+  }
+
+#define OP_HANDLERS \
+    [kOpAdd] = &&op_add, \
+    [kOpSub] = &&op_sub, \
+    [kOpRor] = &&op_ror, \
+    [kOpRol] = &&op_rol, \
+    [kOpShr] = &&op_shr, \
+    [kOpShl] = &&op_shl, \
+    [kOpAnd] = &&op_and, \
+    [kOpOra] = &&op_ora, \
+    [kOpMul] = &&op_mul, \
+    [kOpDiv] = &&op_div, \
+    [kOpCmp] = &&op_cmp, \
+    [kOpJeq] = &&op_jeq, \
+    [kOpXri] = &&op_xri, \
+    [kOpSrr] = &&op_srr, \
+    [kOpSrm] = &&op_srm, \
+    [kOpBrk] = &&op_brk
+
+  // indexed by VMPage.dispatch. superinstructions only run forwards, going
+  // backwards they are replaced by the handler for their first op
+  static const void *const kForwardHandlers[] = {
+    OP_HANDLERS,
+    [kFuseAdd] = &&fuse_add,
+    [kFuseMul] = &&fuse_mul,
+    [kFuseJump] = &&fuse_jump,
+  };
+  static const void *const kBackwardHandlers[] = {
+    OP_HANDLERS,
+    [kFuseAdd] = &&op_add,
+    [kFuseMul] = &&op_mul,
+    [kFuseJump] = &&op_xri,
+  };
+  // while stops are checked every slot dispatches to check_stops, which
+  // dispatches on to the handler for its op
+  static const void *const kCheckedHandlers[] = {
+    [0 ... kFuseJump] = &&check_stops,
+  };
+
+#undef OP_HANDLERS
+
+  // registers and pc live in locals for the duration of the run and are only
+  // written back to the VM on exit
+  uint16_t reg[16];
+  memcpy(reg, vm->reg, sizeof(reg));
+  uint16_t pc = vm->pc;
+
+  // when executing backwards pc moves before the instruction is executed,
+  // and when executing forwards it moves after
+  const uint16_t pc_pre = vm->direction == kExecutingBackward ? -2 : 0;
+  const uint16_t pc_post = vm->direction == kExecutingForward ? 2 : 0;
+
+  const void *const *handlers = vm->direction == kExecutingForward ?
+    kForwardHandlers : kBackwardHandlers;
+  if (stops)
+    handlers = kCheckedHandlers;
+  struct VMPage *const *pages = vm->pages;
+  const struct VMPage *page;
+  struct DecodedInsn insn;
+
+#define DISPATCH() \
+  do { \
+    if (steps == max_steps) goto out; \
+    pc += pc_pre; \
+    page = pages[pc / kVMPageSize]; \
+    insn = page->decoded[pc % kVMPageSize / 2]; \
+    goto *handlers[page->dispatch[pc % kVMPageSize / 2]]; \
+  } while (0)
+
+#define NEXT() \
+  do { \
+    pc += pc_post; \
+    steps++; \
+    DISPATCH(); \
+  } while (0)
+
+  DISPATCH();
+
+  // the backward handlers run every op on its own, in either direction
+check_stops:
+  if (StopsBefore(stops, pc, insn)) {
+    pc -= pc_pre;
+    goto out;
+  }
+  goto *kBackwardHandlers[insn.op];
+
+op_add:
+  reg[insn.x] ^= reg[insn.y] + reg[insn.z];
+  NEXT();
+op_sub:
+  reg[insn.x] ^= reg[insn.y] - reg[insn.z];
+  NEXT();
+op_ror:
+  reg[insn.x] ^= Ror32(reg[insn.y], reg[insn.z] & 0xF);
+  NEXT();
+op_rol:
+  reg[insn.x] ^= Rol32(reg[insn.y], reg[insn.z] & 0xF);
+  NEXT();
+op_shr:
+  reg[insn.x] ^= reg[insn.y] >> (reg[insn.z] & 0xF);
+  NEXT();
+op_shl:
+  reg[insn.x] ^= reg[insn.y] << (reg[insn.z] & 0xF);
+  NEXT();
+op_and:
+  reg[insn.x] ^= reg[insn.y] & reg[insn.z];
+  NEXT();
+op_ora:
+  reg[insn.x] ^= reg[insn.y] | reg[insn.z];
+  NEXT();
+op_mul:
+  reg[insn.x] ^= (unsigned) reg[insn.y] * reg[insn.z];
+  NEXT();
+op_div:
+  if (reg[insn.z] != 0)
+    reg[insn.x] ^= reg[insn.y] / reg[insn.z];
+  NEXT();
+op_cmp: {
+  uint16_t a = reg[insn.y];
+  uint16_t b = reg[insn.z];
+  reg[insn.x] ^= (uint16_t) ((a > b) - (a < b));
+  NEXT();
+}
+op_jeq:
+  if (reg[insn.y] == reg[insn.z]) {
+    uint16_t target = reg[insn.x];
+    if (target & 1) {
+      vm->err = kErrorMisalignedJump;
+      goto out;
+    }
+
+    if (memcmp(InsnBytes(vm, pc), InsnBytes(vm, target), 2) != 0) {
+      vm->err = kErrorMismatchedJump;
+      goto out;
+    }
+    reg[insn.x] = pc;
+    pc = target;
+  }
+  NEXT();
+op_xri:
+  reg[insn.x] ^= (insn.y << 4) | insn.z;
+  NEXT();
+op_srr:
+  if (insn.z >= kSrrCodeCount) {
+    vm->err = kErrorInvalidSrrEncoding;
+    goto out;
+  }
+  PermuteRegs(&reg[insn.x], &reg[insn.y], insn.z);
+  NEXT();
+op_srm:
+  SwapMemory(vm, reg[insn.y], &reg[insn.x]);
+  NEXT();
+op_brk:
+  vm->brk_dir = vm->direction;
+  pc += pc_post;
+  steps++;
+  goto out;
+
+  // superinstructions run their instructions in one go if the budget allows,
+  // and otherwise fall back to the first one on its own. seq[0] is insn
+fuse_add: {
+  if (max_steps - steps < 3) goto op_add;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t a = reg[insn.x], b = reg[insn.y], c = reg[insn.z];
+  a ^= b + c;
+  b ^= a - c;
+  PermuteRegs(&a, &b, seq[2].z);
+  reg[insn.x] = a;
+  reg[insn.y] = b;
+  pc += 4;
+  steps += 2;
+  NEXT();
+}
+fuse_mul: {
+  if (max_steps - steps < 3) goto op_mul;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t a = reg[insn.x], b = reg[insn.y], c = reg[insn.z];
+  a ^= (unsigned) b * c;
+  if (b != 0)
+    c ^= a / b;
+  PermuteRegs(&c, &a, seq[2].z);
+  reg[insn.x] = a;
+  reg[insn.z] = c;
+  pc += 4;
+  steps += 2;
+  NEXT();
+}
+fuse_jump: {
+  if (max_steps - steps < 3) goto op_xri;
+  const struct DecodedInsn *seq = &page->decoded[pc % kVMPageSize / 2];
+  uint16_t target = reg[insn.x] ^ ((insn.y << 4) | insn.z);
+  uint16_t a = reg[seq[1].y];
+  uint16_t b = reg[seq[1].z];
+  uint16_t flag = reg[seq[1].x] ^ (uint16_t) ((a > b) - (a < b));
+  reg[insn.x] = target;
+  reg[seq[1].x] = flag;
+  pc += 4;
+  steps += 2;
+  // the jeq may compare the flag against itself or the target
+  if (flag == reg[seq[2].z]) {
+    if (target & 1) {
+      vm->err = kErrorMisalignedJump;
+      goto out;
+    }
+
+    if (memcmp(InsnBytes(vm, pc), InsnBytes(vm, target), 2) != 0) {
+      vm->err = kErrorMismatchedJump;
+      goto out;
+    }
+    reg[insn.x] = pc;
+    pc = target;
+  }
+  NEXT();
+}
+
+#undef NEXT
+#undef DISPATCH
+
+out:
+  memcpy(vm->reg, reg, sizeof(reg));
+  vm->pc = pc;
+  return steps;
+}
+
+uint64_t ExecuteRun(struct VM *vm, uint64_t max_steps) {
+  return Run(vm, max_steps, NULL);
+}
+
+uint64_t ExecuteRunUntil(struct VM *vm, uint64_t max_steps,
+    const struct VMStops *stops) {
+  return Run(vm, max_steps, stops);
+}
@@ -1,6 +1,8 @@
 #ifndef INVOLUTION16_H_
 #define INVOLUTION16_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 enum {
@@ -42,18 +44,198 @@ extern const char *kErrorStrings[];
 enum {kSrrCodeCount = 8};
 extern const uint8_t kSrrCodes[][4];
 
+// an instruction split into its four nibbles, so that hot loops don't have to
+// redo the split every time they come around
+struct DecodedInsn {
+  uint8_t op;
+  uint8_t x, y, z;
+};
+
+enum {
+  kVMPageSize = 4096,
+  kVMPageCount = 65536 / kVMPageSize,
+  // aligned two byte instruction slots per page
+  kVMPageSlots = kVMPageSize / 2,
+};
+
+// a page of memory along with its decoded instructions. pages are shared
+// copy-on-write between VMs and snapshots and are only ever modified while
+// they have a single reference, so a shared page can be read from any thread
+struct VMPage {
+  _Atomic uint32_t refs;
+  // changes whenever bytes is written, and is never shared by two pages with
+  // different contents, so equal stamps mean equal bytes
+  uint64_t stamp;
+  uint8_t bytes[kVMPageSize];
+  // decoded[i] always mirrors the instruction at bytes + 2 * i
+  struct DecodedInsn decoded[kVMPageSlots];
+  // what ExecuteRun dispatches to at slot i when executing forwards: the op,
+  // or a superinstruction if the slot starts a common idiom that fits in
+  // the page. kept up to date along with decoded
+  uint8_t dispatch[kVMPageSlots];
+};
+
+typedef uint8_t StepKind;
+enum {
+  // an instruction was executed
+  kStepInsn,
+  // pc moved off of a brk that the VM previously stopped at
+  kStepLeaveBrk,
+};
+
+// describes a step that retired. instructions that raise an error don't
+// retire and aren't reported
+struct StepInfo {
+  StepKind kind;
+  ExecutionDirection direction;
+  // pc before and after the step
+  uint16_t pc_before, pc_after;
+  // the rest is only set for kStepInsn
+  uint16_t insn_addr;
+  struct DecodedInsn insn;
+  // the registers named by the x and y fields of the instruction, before and
+  // after the step. for srm, y_old is the address of the memory that was
+  // swapped with x
+  uint16_t x_old, y_old;
+  uint16_t x_new, y_new;
+  // whether a jeq jumped
+  bool taken;
+};
+
+enum {
+  // most steps reported to a StepHook at once
+  kStepBatch = 256,
+};
+
+// a 128 bit hash, see VMStateHash
+struct VMHash {
+  uint64_t lo, hi;
+};
+
+// steps can also be logged in a compact form, which ExecuteRun writes as it
+// goes. a record is a flags byte, followed for instructions by the xor of the
+// old and new values of the x register and, only if it's nonzero and y isn't
+// the same register as x, that of the y register, low byte first. everything
+// else about the step, the instruction included, follows from the state
+// before it
+enum {
+  kStepRecordLeaveBrk = 1 << 0,
+  kStepRecordBackward = 1 << 1,
+  kStepRecordY = 1 << 2,
+
+  // flags, two deltas
+  kStepRecordMaxLen = 1 + 2 + 2,
+  // most steps passed to a StepLog at once
+  kStepLogBatch = 1024,
+};
+
+// a batch of steps, as records
+struct StepRecords {
+  // pc before the first step and after the last
+  uint16_t pc_before, pc_after;
+  // the registers before the first step
+  uint16_t reg_before[16];
+  const uint8_t *data;
+  size_t len;
+  size_t count;
+};
+
+struct VM;
+// called with steps in the order they retired, vm is the state after the last
+// of them. must not modify the VM
+typedef void (*StepHook)(const struct VM *vm, const struct StepInfo *steps,
+  size_t count, void *ctx);
+// as StepHook, for steps logged as records. vm's pc is only that after the
+// last step if the run ended without an error. ExecuteStep and ExecuteRun
+// first pass an empty batch while vm is the state before their first step,
+// so that a log can tell whether the VM changed since the last batch
+typedef void (*StepLog)(const struct VM *vm, const struct StepRecords *steps,
+  void *ctx);
+
 struct VM {
   uint16_t reg[16];
-  // 2^16 and not 2^16 - 1 because technically the last cell of memory is
-  // accessible if you do a two byte read at 0xFFFF
-  uint8_t memory[65536];
+  // memory is only written through srm and VMWriteMemory, two byte accesses at
+  // 0xFFFF wrap around to 0x0000
+  struct VMPage *pages[kVMPageCount];
   uint16_t pc;
   ExecutionDirection direction;
   ExecutionDirection brk_dir;
   ErrorCode err;
+
+  // the xor over every address of a hash of the address and the byte stored
+  // there. only kept up to date by writes once VMMemoryHash has computed it
+  struct VMHash mem_hash;
+  bool mem_hash_valid;
+
+  // if set, called with every step taken. ExecuteStep reports each step as
+  // it happens, ExecuteRun in batches of up to kStepBatch without using
+  // superinstructions
+  StepHook step_hook;
+  void *step_hook_ctx;
+  // as step_hook, in batches of up to kStepLogBatch. this is cheap enough
+  // that ExecuteRun keeps using superinstructions unless there's a step_hook
+  // as well
+  StepLog step_log;
+  void *step_log_ctx;
+};
+
+// a frozen copy of a VM's state that shares memory pages with the VM it was
+// taken from until either side writes to them
+struct VMSnapshot {
+  struct VM state;
 };
 
 struct VM *VMCreate(void);
+void VMDestroy(struct VM *);
+// puts vm back in the state VMCreate leaves it in, with every register zero
+// and memory filled with brk, releasing its pages. the step hook and step log
+// are kept
+void VMReset(struct VM *);
+// creates an independent VM with the same state as vm, sharing every page of
+// memory until one of them writes to it. the fork has no step hook
+struct VM *VMFork(const struct VM *vm);
+
+struct VMSnapshot *VMSnapshot(const struct VM *);
+void VMSnapshotDestroy(struct VMSnapshot *);
+// sets the state of vm to the state saved in the snapshot. the step hook of
+// vm is kept
+void VMRestore(struct VM *vm, const struct VMSnapshot *);
+
+uint8_t VMReadByte(const struct VM *, uint16_t addr);
+void VMReadMemory(const struct VM *, uint16_t addr, void *dst, size_t len);
+// copies len bytes from src into memory starting at addr
+void VMWriteMemory(struct VM *, uint16_t addr, const void *src, size_t len);
+
+// a hash of all of memory. the first call for a VM reads every byte, after
+// that each write updates the hash in constant time, so calling it between
+// steps costs next to nothing. VMFork and VMSnapshot carry the hash over
+struct VMHash VMMemoryHash(struct VM *);
+// a hash of the registers, pc, direction, brk_dir, err and memory, costing
+// the same as VMMemoryHash. equal states hash equal, and hashes are the same
+// on every machine, so they can be stored and compared between runs
+struct VMHash VMStateHash(struct VM *);
+
 void ExecuteStep(struct VM *vm);
+// executes up to max_steps instructions in the current direction, stopping
+// early on a brk or an error. returns the number of steps retired, where an
+// instruction that raises an error does not count as retired
+uint64_t ExecuteRun(struct VM *vm, uint64_t max_steps);
+
+// the instructions ExecuteRunUntil stops before
+struct VMStops {
+  // bit addr % 64 of breakpoints[addr / 64] is set for every instruction
+  // address to stop at. may be NULL
+  const uint64_t *breakpoints;
+  // stops before any instruction that may write a register whose bit is set
+  uint16_t regs;
+  // stops before any srm
+  bool mem;
+};
+
+// as ExecuteRun, also stopping before executing an instruction picked out by
+// stops, including the first. going backwards, the next instruction is the
+// one before pc. superinstructions aren't used while stops are checked
+uint64_t ExecuteRunUntil(struct VM *vm, uint64_t max_steps,
+  const struct VMStops *stops);
 
 #endif
\ No newline at end of file
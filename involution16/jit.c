@@ -0,0 +1,439 @@
+// for memfd_create
+#define _GNU_SOURCE
+
+#include "jit.h"
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+enum {
+  // longest run of instructions compiled into one block
+  kJitMaxBlock = 64,
+  // longest code generated for an alu instruction (cmp), for the jeq that
+  // can end a block (going forwards) and for the mov and ret that end any
+  // other block
+  kJitMaxAluCode = 22,
+  kJitMaxJeqCode = 76,
+  kJitRetCode = 6,
+  kJitArenaSize = 8 << 20,
+};
+
+// compiled code is called with the vm's registers and pages. it returns the
+// pc to continue from, with kJitRetired set if a jeq ending the block retired
+typedef uint32_t (*JitCode)(uint16_t *reg, struct VMPage *const *pages);
+
+enum {
+  kJitRetired = 1 << 16,
+};
+
+struct JitBlock {
+  // NULL if the block is empty
+  JitCode code;
+  // stamp of the page the last time the block was found to match it
+  uint64_t stamp;
+  // alu instructions compiled, plus one if the block ends with a jeq. the jeq
+  // doesn't retire if the jump would raise an error, leaving pc at it so that
+  // ExecuteStep raises the error
+  uint16_t len;
+  uint16_t max_steps;
+  // the bytes the block was compiled from, including the instruction that
+  // ended it when that is on the same page, and where they are in the page
+  uint16_t src_offset;
+  uint16_t src_len;
+  uint8_t src[2 * (kJitMaxBlock + 1)];
+};
+
+struct Jit {
+  // code is written to arena, which is mapped read/write, and runs from the
+  // same memory mapped again at exec, read/execute, so no page is ever
+  // writable and executable at once. filled from the start and reset all at
+  // once when full
+  uint8_t *arena;
+  const uint8_t *exec;
+  size_t arena_used;
+  // indexed by whether the block runs backwards, then by the pc it starts
+  // from / 2. a backwards block starts from the address after its last
+  // instruction and executes them in reverse
+  struct JitBlock *blocks[2][65536 / 2];
+};
+
+struct Jit *JitCreate(void) {
+  int fd = memfd_create("involution16-jit", MFD_CLOEXEC);
+  if (fd == -1) return NULL;
+
+  void *arena = MAP_FAILED, *exec = MAP_FAILED;
+  if (ftruncate(fd, kJitArenaSize) == 0) {
+    arena = mmap(NULL, kJitArenaSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+      0);
+    exec = mmap(NULL, kJitArenaSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+  }
+  // the mappings keep the memory alive
+  close(fd);
+  if (arena == MAP_FAILED || exec == MAP_FAILED) {
+    if (arena != MAP_FAILED) munmap(arena, kJitArenaSize);
+    if (exec != MAP_FAILED) munmap(exec, kJitArenaSize);
+    return NULL;
+  }
+
+  struct Jit *jit = calloc(1, sizeof(*jit));
+  Assume(jit);
+  jit->arena = arena;
+  jit->exec = exec;
+  return jit;
+}
+
+static void JitFlush(struct Jit *jit) {
+  for (size_t dir = 0; dir < 2; dir++) {
+    for (size_t i = 0; i < 65536 / 2; i++) {
+      free(jit->blocks[dir][i]);
+      jit->blocks[dir][i] = NULL;
+    }
+  }
+  jit->arena_used = 0;
+}
+
+void JitDestroy(struct Jit *jit) {
+  JitFlush(jit);
+  munmap(jit->arena, kJitArenaSize);
+  munmap((void *) jit->exec, kJitArenaSize);
+  free(jit);
+}
+
+// whether an alu instruction is compiled, rather than ending a block. a jeq
+// ends a block, but is compiled as part of it
+static bool IsCompiled(struct DecodedInsn insn) {
+  switch (insn.op) {
+    case kOpJeq:
+    case kOpSrm:
+    case kOpBrk:
+      return false;
+    case kOpSrr:
+      return insn.z < kSrrCodeCount;
+    default:
+      return true;
+  }
+}
+
+// x86-64 code generation. the register file is addressed as [rdi + disp8],
+// rsi points at the pages, and eax, ecx and edx are scratch
+
+static uint8_t *Emit(uint8_t *p, size_t n, const uint8_t *bytes) {
+  memcpy(p, bytes, n);
+  return p + n;
+}
+
+#define EMIT(p, ...) \
+  Emit(p, sizeof((uint8_t[]) {__VA_ARGS__}), (uint8_t[]) {__VA_ARGS__})
+
+enum {
+  kEax = 0,
+  kEcx = 1,
+};
+
+// movzx r32, word [rdi + 2 * r]
+static uint8_t *EmitLoad(uint8_t *p, int dst, uint8_t r) {
+  return EMIT(p, 0x0F, 0xB7, 0x47 | dst << 3, r * 2);
+}
+
+// xor word [rdi + 2 * r], ax
+static uint8_t *EmitXorAx(uint8_t *p, uint8_t r) {
+  return EMIT(p, 0x66, 0x31, 0x47, r * 2);
+}
+
+static uint8_t *EmitInsn(uint8_t *p, struct DecodedInsn insn) {
+  uint8_t x = insn.x, y = insn.y, z = insn.z;
+  switch (insn.op) {
+    case kOpAdd:
+    case kOpSub:
+    case kOpAnd:
+    case kOpOra: {
+      static const uint8_t kAluOps[] = {
+        [kOpAdd] = 0x03,
+        [kOpSub] = 0x2B,
+        [kOpAnd] = 0x23,
+        [kOpOra] = 0x0B,
+      };
+      // op ax, word [rdi + 2 * z]
+      p = EmitLoad(p, kEax, y);
+      p = EMIT(p, 0x66, kAluOps[insn.op], 0x47, z * 2);
+      return EmitXorAx(p, x);
+    }
+    // on 16-bit values, the 32-bit rotates truncated to 16 bits are shifts
+    case kOpRor:
+    case kOpShr:
+    case kOpRol:
+    case kOpShl: {
+      bool right = insn.op == kOpRor || insn.op == kOpShr;
+      p = EmitLoad(p, kEax, y);
+      p = EmitLoad(p, kEcx, z);
+      // and ecx, 15; shr/shl eax, cl
+      p = EMIT(p, 0x83, 0xE1, 0x0F, 0xD3, right ? 0xE8 : 0xE0);
+      return EmitXorAx(p, x);
+    }
+    case kOpMul:
+      p = EmitLoad(p, kEax, y);
+      p = EmitLoad(p, kEcx, z);
+      // imul eax, ecx
+      p = EMIT(p, 0x0F, 0xAF, 0xC1);
+      return EmitXorAx(p, x);
+    case kOpDiv:
+      p = EmitLoad(p, kEcx, z);
+      // test ecx, ecx; jz over the division
+      p = EMIT(p, 0x85, 0xC9, 0x74, 12);
+      p = EmitLoad(p, kEax, y);
+      // xor edx, edx; div ecx
+      p = EMIT(p, 0x31, 0xD2, 0xF7, 0xF1);
+      return EmitXorAx(p, x);
+    case kOpCmp:
+      p = EmitLoad(p, kEax, y);
+      p = EmitLoad(p, kEcx, z);
+      // xor edx, edx; cmp eax, ecx; seta dl; sbb edx, 0
+      p = EMIT(p, 0x31, 0xD2, 0x39, 0xC8, 0x0F, 0x97, 0xC2, 0x83, 0xDA, 0x00);
+      // xor word [rdi + 2 * x], dx
+      return EMIT(p, 0x66, 0x31, 0x57, x * 2);
+    case kOpXri:
+      // xor word [rdi + 2 * x], imm16
+      return EMIT(p, 0x66, 0x81, 0x77, x * 2, y << 4 | z, 0);
+    case kOpSrr: {
+      // the four bytes of x and y are al, ah, cl and ch, each stored back
+      // with a byte mov to wherever the permutation puts it
+      static const uint8_t kByteRegs[4] = {0, 4, 1, 5};
+      const uint8_t disp[4] = {x * 2, x * 2 + 1, y * 2, y * 2 + 1};
+      p = EmitLoad(p, kEax, x);
+      p = EmitLoad(p, kEcx, y);
+      for (int i = 0; i < 4; i++) {
+        uint8_t src = kByteRegs[kSrrCodes[z][i]];
+        // mov byte [rdi + disp], r8
+        p = EMIT(p, 0x88, 0x47 | src << 3, disp[i]);
+      }
+      return p;
+    }
+  }
+  abort();
+}
+
+// points the rel8 jump ending at from to target
+static void PatchJump(uint8_t *from, const uint8_t *target) {
+  from[-1] = target - from;
+}
+
+// the jeq at addr with the given encoding, returning the pc to continue from.
+// pc moves past the instruction after it executes going forwards, and before
+// it going backwards
+static uint8_t *EmitJeq(uint8_t *p, struct DecodedInsn insn, uint16_t addr,
+    const uint8_t bytes[2], bool backward) {
+  uint8_t x = insn.x, y = insn.y, z = insn.z;
+  uint16_t next = backward ? addr : addr + 2;
+  uint16_t fail = backward ? addr + 2 : addr;
+  const uint32_t bytes_offset = offsetof(struct VMPage, bytes);
+
+  // movzx eax, word [rdi + 2 * y]; cmp ax, word [rdi + 2 * z]; jne not_taken
+  p = EmitLoad(p, kEax, y);
+  p = EMIT(p, 0x66, 0x3B, 0x47, z * 2, 0x75, 0);
+  uint8_t *jump_not_taken = p;
+
+  // the target must be aligned: movzx eax, word [rdi + 2 * x]; test al, 1;
+  // jnz fail
+  p = EmitLoad(p, kEax, x);
+  p = EMIT(p, 0xA8, 0x01, 0x75, 0);
+  uint8_t *jump_misaligned = p;
+  // and hold the same instruction: mov ecx, eax; shr ecx, 12;
+  // mov rcx, [rsi + rcx * 8]; and eax, 0xFFF;
+  // cmp word [rcx + rax + bytes_offset], insn; jne fail
+  p = EMIT(p, 0x89, 0xC1, 0xC1, 0xE9, 0x0C, 0x48, 0x8B, 0x0C, 0xCE);
+  p = EMIT(p, 0x25, 0xFF, 0x0F, 0x00, 0x00);
+  p = EMIT(p, 0x66, 0x81, 0xBC, 0x01,
+    bytes_offset, bytes_offset >> 8, bytes_offset >> 16, bytes_offset >> 24,
+    bytes[0], bytes[1]);
+  p = EMIT(p, 0x75, 0);
+  uint8_t *jump_mismatched = p;
+
+  // swap pc with the target, moving on past it going forwards:
+  // movzx eax, word [rdi + 2 * x]; mov word [rdi + 2 * x], addr; add ax, 2;
+  // or eax, kJitRetired; ret
+  p = EmitLoad(p, kEax, x);
+  p = EMIT(p, 0x66, 0xC7, 0x47, x * 2, addr, addr >> 8);
+  if (!backward)
+    p = EMIT(p, 0x66, 0x83, 0xC0, 0x02);
+  p = EMIT(p, 0x0D, 0x00, 0x00, 0x01, 0x00, 0xC3);
+
+  // not_taken: mov eax, next | kJitRetired; ret
+  PatchJump(jump_not_taken, p);
+  p = EMIT(p, 0xB8, next, next >> 8, 0x01, 0x00, 0xC3);
+
+  // fail, leaving pc where it was: mov eax, fail; ret
+  PatchJump(jump_misaligned, p);
+  PatchJump(jump_mismatched, p);
+  p = EMIT(p, 0xB8, fail, fail >> 8, 0x00, 0x00, 0xC3);
+  return p;
+}
+
+#undef EMIT
+
+// the page holding the first instruction executed by a block starting at pc
+static size_t BlockPage(uint16_t pc, bool backward) {
+  return (uint16_t) (pc - 2 * backward) / kVMPageSize;
+}
+
+// compiles the block starting at pc, which can't cross into another page
+static struct JitBlock *Compile(struct Jit *jit, const struct VMPage *page,
+    uint16_t pc, bool backward) {
+  // the block is made of slots [lo, hi) and executes them in order going
+  // forwards, in reverse going backwards
+  const size_t page_base = BlockPage(pc, backward) * kVMPageSize;
+  size_t lo, hi;
+  if (backward) {
+    hi = (uint16_t) (pc - 2) % kVMPageSize / 2 + 1;
+    lo = hi;
+    while (hi - lo < kJitMaxBlock && lo > 0 &&
+        IsCompiled(page->decoded[lo - 1]))
+      lo--;
+  } else {
+    lo = pc % kVMPageSize / 2;
+    hi = lo;
+    while (hi - lo < kJitMaxBlock && hi < kVMPageSlots &&
+        IsCompiled(page->decoded[hi]))
+      hi++;
+  }
+  size_t len = hi - lo;
+
+  // the slot of the instruction that ended the block, if it's on this page
+  bool ended = len < kJitMaxBlock &&
+    (backward ? lo > 0 : hi < kVMPageSlots);
+  size_t end_slot = backward ? lo - 1 : hi;
+  bool jeq = ended && page->decoded[end_slot].op == kOpJeq;
+
+  struct JitBlock *blk = malloc(sizeof(*blk));
+  Assume(blk);
+  blk->code = NULL;
+  blk->stamp = page->stamp;
+  blk->len = len;
+  blk->max_steps = len + jeq;
+  blk->src_offset = 2 * (backward ? lo - ended : lo);
+  blk->src_len = 2 * (len + ended);
+  memcpy(blk->src, page->bytes + blk->src_offset, blk->src_len);
+
+  if (blk->max_steps > 0) {
+    size_t need = len * kJitMaxAluCode + (jeq ? kJitMaxJeqCode : kJitRetCode);
+    if (jit->arena_used + need > kJitArenaSize)
+      JitFlush(jit);
+
+    uint8_t *start = jit->arena + jit->arena_used;
+    uint8_t *p = start;
+    for (size_t i = 0; i < len; i++)
+      p = EmitInsn(p, page->decoded[backward ? hi - 1 - i : lo + i]);
+
+    if (jeq) {
+      uint16_t addr = page_base + 2 * end_slot;
+      p = EmitJeq(p, page->decoded[end_slot], addr,
+        page->bytes + 2 * end_slot, backward);
+    } else {
+      // mov eax, end; ret
+      uint16_t end = page_base + 2 * (backward ? lo : hi);
+      const uint8_t ret[] = {0xB8, end, end >> 8, 0x00, 0x00, 0xC3};
+      memcpy(p, ret, sizeof(ret));
+      p += sizeof(ret);
+    }
+
+    // the code is position independent, so it runs as is from exec
+    blk->code = (JitCode) (jit->exec + jit->arena_used);
+    jit->arena_used += p - start;
+  }
+
+  free(jit->blocks[backward][pc / 2]);
+  jit->blocks[backward][pc / 2] = blk;
+  return blk;
+}
+
+// returns the block starting at pc, compiling it if the cached block (if any)
+// no longer matches memory
+static struct JitBlock *Lookup(struct Jit *jit, const struct VM *vm,
+    uint16_t pc, bool backward) {
+  const struct VMPage *page = vm->pages[BlockPage(pc, backward)];
+  struct JitBlock *blk = jit->blocks[backward][pc / 2];
+  if (blk && blk->stamp == page->stamp) return blk;
+
+  if (blk && memcmp(blk->src, page->bytes + blk->src_offset,
+      blk->src_len) == 0) {
+    blk->stamp = page->stamp;
+    return blk;
+  }
+  return Compile(jit, page, pc, backward);
+}
+
+uint64_t JitRun(struct Jit *jit, struct VM *vm, uint64_t max_steps) {
+  if (vm->step_hook || vm->step_log)
+    return ExecuteRun(vm, max_steps);
+
+  const bool backward = vm->direction == kExecutingBackward;
+  uint64_t steps = 0;
+  while (steps < max_steps && !vm->err && vm->brk_dir != vm->direction) {
+    // stepping off a brk and unaligned code are left to the interpreter
+    if (vm->brk_dir || vm->pc & 1) {
+      ExecuteStep(vm);
+      if (vm->err) break;
+      steps++;
+      continue;
+    }
+
+    struct JitBlock *blk = Lookup(jit, vm, vm->pc, backward);
+    if (!blk->code) {
+      // pc is at an instruction that isn't compiled
+      ExecuteStep(vm);
+      if (vm->err) break;
+      steps++;
+    } else if (blk->max_steps <= max_steps - steps) {
+      uint32_t ret = blk->code(vm->reg, vm->pages);
+      vm->pc = ret;
+      steps += blk->len;
+      if (ret & kJitRetired) {
+        steps++;
+      } else if (blk->max_steps > blk->len) {
+        // the jump would raise an error, which the interpreter sets
+        ExecuteStep(vm);
+        if (vm->err) break;
+        steps++;
+      }
+    } else {
+      // the block doesn't fit in what's left of the budget
+      steps += ExecuteRun(vm, max_steps - steps);
+      break;
+    }
+  }
+  return steps;
+}
+
+#else
+
+struct Jit *JitCreate(void) {
+  return NULL;
+}
+
+void JitDestroy(struct Jit *jit) {
+  (void) jit;
+}
+
+uint64_t JitRun(struct Jit *jit, struct VM *vm, uint64_t max_steps) {
+  (void) jit;
+  return ExecuteRun(vm, max_steps);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "involution16.h"
+
+#include <stdint.h>
+
+// compiles straight line runs of alu instructions into native code, in either
+// direction: as every alu instruction is its own inverse, a block run
+// backwards is the same instructions in reverse order. a jeq ending a block is
+// compiled too, anything else (srm, brk, invalid srr, a jump that raises an
+// error) is left to ExecuteStep, so errors and the final state are exactly as
+// if the vm was interpreted
+//
+// blocks are cached by address and checked against the stamp of the page they
+// were compiled from, so a VM that rewrites its own code just costs a
+// recompile. a Jit can be used with any number of VMs, but only from one
+// thread at a time
+struct Jit;
+
+// returns NULL if the platform isn't supported or executable memory couldn't
+// be mapped
+struct Jit *JitCreate(void);
+void JitDestroy(struct Jit *);
+
+// same contract as ExecuteRun. falls back to ExecuteRun while the vm has a
+// step hook or step log
+uint64_t JitRun(struct Jit *, struct VM *vm, uint64_t max_steps);
+
+#endif
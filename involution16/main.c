@@ -1,83 +1,678 @@
+#include "analyze.h"
+#include "asm.h"
+#include "corpus.h"
 #include "debugger.h"
 #include "involution16.h"
 #include "disasm.h"
+#include "farm.h"
+#include "jit.h"
+#include "profile.h"
+#include "rom.h"
+#include "symbols.h"
+#include "trace.h"
+#include "verify.h"
+#include "wide.h"
 
 #include "utui.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
 // TODO: enforce first argument being unique from remaining arguments
 
-static void Assume(bool cond) {
-  if (!cond) {
-    perror("error");
+// TODO: toggle colors
+// prints the disassembly of the rom with a single write. syms may be NULL
+static void DumpDisasm(size_t len, const uint8_t *input,
+    const struct Symbols *syms) {
+  size_t cap = (len + 1) / 2 * kMaxDisasmLineLen;
+  char *text = malloc(cap);
+  DisAsmFmt *fmt = malloc(cap);
+  // every char may change the color, with "\x1b[3Nm", and the colors are
+  // reset at the end
+  char *out = malloc(cap * 6 + 3);
+  if (!text || !fmt || !out) {
+    perror("malloc");
     exit(EXIT_FAILURE);
   }
+
+  size_t n = DisasmRange(input, len, syms, text, fmt);
+  size_t out_len = 0;
+  DisAsmFmt color = 0;
+  for (size_t i = 0; i < n; i++) {
+    // the color of each DisAsmFmt is 30 + its digit
+    if (fmt[i] != color) {
+      memcpy(out + out_len, "\x1b[3", 3);
+      out[out_len + 3] = fmt[i];
+      out[out_len + 4] = 'm';
+      out_len += 5;
+      color = fmt[i];
+    }
+    out[out_len++] = text[i];
+  }
+  memcpy(out + out_len, "\x1b[m", 3);
+  out_len += 3;
+
+  fflush(stdout);
+  for (size_t i = 0; i < out_len;) {
+    ssize_t written = write(STDOUT_FILENO, out + i, out_len - i);
+    if (written <= 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    i += written;
+  }
+
+  free(out);
+  free(fmt);
+  free(text);
 }
 
-// TODO: toggle colors
-static void DumpDisasm(size_t len, uint8_t *input) {
-  for (size_t i = 0; i < len; i += 2) {
-    char line[kMaxInsnStrLen + 1];
-    struct UTuiStyle style[sizeof(line)] = {0};
-    DisAsmFmt fmt[kMaxInsnStrLen];
-
-    size_t n = InsnToStr(input + i, line, fmt);
-
-    // convert DisAsmFmt to UTuiStyle
-    for (size_t j = 0; j < n; j++) {
-      style[j].fg.kind = kUTuiColorIndexed;
-      style[j].fg.color[0] = 30 + fmt[j] - '0';
+// reads the whole rom file at path into buf, exiting on failure
+static void LoadRom(const char *path, uint8_t *buf, size_t *len) {
+  if (!RomRead(path, buf, len)) {
+    if (errno == EFBIG)
+      fprintf(stderr, "rom file too large\n");
+    else
+      perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// reads the whole of the file at path, which unlike a rom may be any size,
+// returning NULL with errno set on failure
+static char *LoadSource(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+
+  size_t cap = 4096, n = 0;
+  char *data = malloc(cap);
+  while (data) {
+    n += fread(data + n, 1, cap - n, f);
+    if (n < cap) break;
+    cap *= 2;
+    char *grown = realloc(data, cap);
+    if (!grown) free(data);
+    data = grown;
+  }
+
+  if (!data || ferror(f)) {
+    int saved_errno = data ? EIO : ENOMEM;
+    free(data);
+    fclose(f);
+    errno = saved_errno;
+    return NULL;
+  }
+  fclose(f);
+  *len = n;
+  return data;
+}
+
+// assembles the source at path into a rom at out_path
+static int RunAsmMode(const char *path, const char *out_path) {
+  size_t len;
+  char *src = LoadSource(path, &len);
+  if (!src) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  struct Assembler *as = AssemblerCreate();
+  static uint8_t rom[kRomMaxLen];
+  size_t rom_len;
+  int status = EXIT_SUCCESS;
+  if (!Assemble(as, src, len, rom, &rom_len)) {
+    fprintf(stderr, "%s:%zu: %s\n", path, as->err_line, as->err);
+    status = EXIT_FAILURE;
+  } else {
+    FILE *f = fopen(out_path, "wb");
+    if (!f || fwrite(rom, 1, rom_len, f) != rom_len || fclose(f) != 0) {
+      perror(out_path);
+      status = EXIT_FAILURE;
     }
+  }
+
+  AssemblerDestroy(as);
+  free(src);
+  return status;
+}
+
+// reports every instruction of the rom at path that can't be run backwards,
+// failing if there are any
+static int RunCheckMode(const char *path) {
+  static uint8_t rom[kRomMaxLen];
+  size_t len;
+  LoadRom(path, rom, &len);
 
-    line[n] = '\n';
-    n++;
+  struct Analyzer *a = AnalyzerCreate();
+  size_t count = Analyze(a, rom, len);
+  for (size_t i = 0; i < count; i++) {
+    const struct AnalyzeIssue *issue = &a->issues[i];
+    uint8_t insn[2] = {
+      issue->addr < len ? rom[issue->addr] : 0xFF,
+      issue->addr + 1u < len ? rom[issue->addr + 1] : 0xFF,
+    };
+    char disasm[kMaxInsnStrLen + 1];
+    disasm[InsnToStr(insn, disasm, NULL)] = '\0';
 
-    UTui_Write(n, line, style);
+    printf("0x%04X\t%s\t%s", issue->addr, disasm, kIssueStrings[issue->kind]);
+    if (issue->kind == kIssueMisalignedJump ||
+        issue->kind == kIssueMismatchedJump)
+      printf(" @ 0x%04X", issue->target);
+    printf("\n");
   }
-  printf("\x1b[m");
+
+  AnalyzerDestroy(a);
+  return count ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "expected exactly one filename argument\n");
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// runs the vm to completion without a tui and prints the final state,
+// returns the exit status for the process. jit may be NULL
+static int RunHeadless(struct VM *vm, uint64_t max_steps, struct Jit *jit) {
+  double start = Now();
+  uint64_t steps = jit ? JitRun(jit, vm, max_steps) : ExecuteRun(vm, max_steps);
+  double elapsed = Now() - start;
+
+  printf("pc  0x%04X\n", vm->pc);
+  for (int i = 0; i < 16; i++) {
+    printf("r%X  0x%04X  %5u\n", i, vm->reg[i], vm->reg[i]);
+  }
+
+  printf("steps  %" PRIu64 "\n", steps);
+  if (elapsed > 0)
+    printf("steps/s  %.0f\n", steps / elapsed);
+
+  if (vm->err) {
+    fprintf(stderr, "error @ pc=0x%04X - %s\n", vm->pc, kErrorStrings[vm->err]);
+    return EXIT_FAILURE;
+  }
+
+  if (vm->brk_dir != vm->direction) {
+    fprintf(stderr, "step limit reached @ pc=0x%04X\n", vm->pc);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static size_t DefaultThreads(size_t num_threads) {
+  if (num_threads != 0) return num_threads;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+static int RunCorpusFarmMode(const char *path, size_t num_threads,
+    uint64_t max_steps, bool verify) {
+  struct CorpusReader *corpus = CorpusOpen(path, true);
+  if (!corpus) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  size_t failures;
+  if (verify) {
+    struct VerifyFarmCtx ctx = {
+      .max_steps = max_steps,
+      .corpus = corpus,
+      .path = path,
+    };
+    RunFarmItems(corpus->count, DefaultThreads(num_threads),
+      FarmVerifyCorpusEntry, &ctx);
+    failures = atomic_load(&ctx.failures);
+  } else {
+    struct FarmCorpusCtx ctx = {
+      .corpus = corpus,
+      .path = path,
+      .max_steps = max_steps,
+    };
+    RunFarmItems(corpus->count, DefaultThreads(num_threads),
+      FarmRunCorpusEntry, &ctx);
+    failures = atomic_load(&ctx.failures);
+  }
+
+  CorpusClose(corpus);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int RunFarmMode(const char *path, size_t num_threads,
+    uint64_t max_steps) {
+  if (CorpusProbe(path))
+    return RunCorpusFarmMode(path, num_threads, max_steps, false);
+
+  size_t count;
+  char **paths = FarmCollectRoms(path, &count);
+  if (!paths) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  RunFarm(paths, count, DefaultThreads(num_threads), FarmRunRom, &max_steps);
+
+  for (size_t i = 0; i < count; i++) free(paths[i]);
+  free(paths);
+  return EXIT_SUCCESS;
+}
+
+static int RunVerifyMode(const char *path, size_t num_threads,
+    uint64_t max_steps) {
+  if (CorpusProbe(path))
+    return RunCorpusFarmMode(path, num_threads, max_steps, true);
+
+  size_t count;
+  char **paths = FarmCollectRoms(path, &count);
+  if (!paths) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  struct VerifyFarmCtx ctx = {.max_steps = max_steps};
+  RunFarm(paths, count, DefaultThreads(num_threads), FarmVerifyRom, &ctx);
+
+  for (size_t i = 0; i < count; i++) free(paths[i]);
+  free(paths);
+  return atomic_load(&ctx.failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// appends every rom in a directory or manifest to the corpus at out_path,
+// recording how each one ends if expect is set
+static int RunPackMode(const char *path, const char *out_path, bool expect,
+    uint64_t max_steps) {
+  size_t count;
+  char **paths = FarmCollectRoms(path, &count);
+  if (!paths) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  struct CorpusWriter *w = CorpusWriterOpen(out_path);
+  if (!w) {
+    perror(out_path);
+    for (size_t i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  static uint8_t rom[kRomMaxLen];
+  for (size_t i = 0; i < count; i++) {
+    struct CorpusEntry e = {
+      .rom = rom,
+      .flags = kCorpusHasName,
+      .name = paths[i],
+      .name_len = strlen(paths[i]),
+    };
+    if (!RomRead(paths[i], rom, &e.rom_len)) {
+      perror(paths[i]);
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    if (expect) {
+      struct VM *vm = CorpusCreateVM(&e);
+      CorpusSetResult(&e, vm, ExecuteRun(vm, max_steps), max_steps);
+      VMDestroy(vm);
+    }
+    CorpusWriterAdd(w, &e);
+  }
+
+  if (!CorpusWriterFinish(w)) {
+    perror(out_path);
+    status = EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < count; i++) free(paths[i]);
+  free(paths);
+  return status;
+}
+
+// a line of a --sweep vectors file, the registers to start a run from
+struct SweepVector {
+  size_t line;
+  uint16_t reg[16];
+};
+
+// reads the vectors file at path, one vector per line as up to 16 numbers for
+// r0 onwards, the rest being 0. blank lines and lines starting with '#' are
+// skipped. exits on failure
+static struct SweepVector *LoadVectors(const char *path, size_t *count) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
     exit(EXIT_FAILURE);
   }
 
-  FILE *f = fopen(argv[1], "rb");
-  Assume(f);
-  int success = fseek(f, 0, SEEK_END);
-  Assume(!success);
-  size_t len = ftell(f);
-  Assume(len >= 0);
-  if (len > 65535) {
-    fprintf(stderr, "rom file too large\n");
+  struct SweepVector *vecs = NULL;
+  size_t n = 0, cap = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  for (size_t line_num = 1; getline(&line, &line_cap, f) != -1; line_num++) {
+    char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\n' || *p == '\r' || *p == '\0' || *p == '#') continue;
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      vecs = realloc(vecs, cap * sizeof(*vecs));
+      if (!vecs) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    struct SweepVector *v = &vecs[n++];
+    memset(v, 0, sizeof(*v));
+    v->line = line_num;
+
+    for (size_t r = 0;; r++) {
+      while (*p == ' ' || *p == '\t') p++;
+      if (*p == '\n' || *p == '\r' || *p == '\0') break;
+
+      char *end;
+      unsigned long value = strtoul(p, &end, 0);
+      if (r == 16 || end == p || value > 0xFFFF ||
+          (*end != ' ' && *end != '\t' && *end != '\n' && *end != '\r' &&
+            *end != '\0')) {
+        fprintf(stderr, "%s:%zu: expected up to 16 register values\n", path,
+          line_num);
+        exit(EXIT_FAILURE);
+      }
+      v->reg[r] = value;
+      p = end;
+    }
+  }
+
+  if (ferror(f)) {
+    perror(path);
     exit(EXIT_FAILURE);
   }
-  rewind(f);
-  uint8_t *input = malloc(len);
-  Assume(input);
-  size_t bytes_read = fread(input, 1, len, f);
-  Assume(len == bytes_read);
-  int close_err = fclose(f);
-  Assume(close_err != EOF);
+  free(line);
+  fclose(f);
+  *count = n;
+  return vecs;
+}
+
+// runs the rom at path from every register vector in the file at
+// vectors_path, kWideLanes at a time, and reports each run as --farm does,
+// named after the vector's line
+static int RunSweepMode(const char *path, const char *vectors_path,
+    uint64_t max_steps) {
+  size_t count;
+  struct SweepVector *vecs = LoadVectors(vectors_path, &count);
+
+  static uint8_t rom[kRomMaxLen];
+  size_t len;
+  LoadRom(path, rom, &len);
+  struct VM *vm = VMCreate();
+  VMWriteMemory(vm, 0, rom, len);
+
+  for (size_t i = 0; i < count; i += kWideLanes) {
+    // a short final batch fills its spare lanes with copies of its last
+    // vector, which keeps them in lockstep with it
+    size_t lanes = count - i < kWideLanes ? count - i : kWideLanes;
+    struct WideVM *wide = WideVMCreate(vm);
+    for (size_t j = 0; j < kWideLanes; j++) {
+      const struct SweepVector *v = &vecs[i + (j < lanes ? j : lanes - 1)];
+      memcpy(wide->lanes[j]->reg, v->reg, sizeof(v->reg));
+    }
+    WideRun(wide, max_steps);
+
+    for (size_t j = 0; j < lanes; j++) {
+      const struct VM *lane = wide->lanes[j];
+      const char *status = "limit";
+      if (lane->err)
+        status = "error";
+      else if (lane->brk_dir == lane->direction)
+        status = "brk";
+
+      printf("%s:%zu\t%s\t%" PRIu64 "\t%04X\t", vectors_path,
+        vecs[i + j].line, status, wide->steps[j], lane->pc);
+      for (int r = 0; r < 16; r++)
+        printf("%04X\t", lane->reg[r]);
+      printf("%u\t%s\n", lane->err, kErrorStrings[lane->err]);
+    }
+    WideVMDestroy(wide);
+  }
+
+  VMDestroy(vm);
+  free(vecs);
+  return EXIT_SUCCESS;
+}
+
+static void Usage(void) {
+  fprintf(stderr,
+    "usage: involution16 [--max-steps n] [--symbols file] rom\n"
+    "       involution16 --run [--max-steps n] [--jit] [--trace file]"
+    " [--profile] rom\n"
+    "       involution16 --farm [-j n] [--max-steps n] dir|manifest\n"
+    "       involution16 --verify [-j n] --max-steps n dir|manifest\n"
+    "       involution16 --sweep vectors [--max-steps n] rom\n"
+    "       involution16 --check rom\n"
+    "       involution16 --asm source -o rom\n"
+    "       involution16 --pack [--expect --max-steps n] dir|manifest"
+    " -o corpus\n"
+    "  --run          execute the rom to a brk or error without the debugger\n"
+    "  --jit          compile the rom to native code as it runs\n"
+    "  --farm         execute every rom in a directory or manifest in parallel\n"
+    "  --verify       check that running each rom backwards undoes running it\n"
+    "                 forwards, in parallel\n"
+    "  --sweep        run the rom from every line of register values in\n"
+    "                 vectors, several runs at once\n"
+    "  --check        report instructions that can't be run backwards, without\n"
+    "                 running the rom\n"
+    "  --asm          assemble a source written for fasm/involution16.inc\n"
+    "  --pack         append every rom in a directory or manifest to a corpus,\n"
+    "                 which --farm and --verify accept in place of either\n"
+    "  --expect       record how each packed rom ends, for --farm to check\n"
+    "  -j n           number of threads, defaults to one per cpu\n"
+    "  --max-steps n  stop each run after n steps\n"
+    "  --trace file   record every step of the run to file\n"
+    "  --profile      report how often each instruction of the run executed\n"
+    "  --symbols file name addresses in the debugger after the symbols in file\n");
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t ParseCount(const char *s) {
+  char *end;
+  uint64_t n = strtoull(s, &end, 0);
+  if (*s == '\0' || *end != '\0') Usage();
+  return n;
+}
+
+int main(int argc, char **argv) {
+  bool headless = false;
+  bool farm = false;
+  bool verify = false;
+  bool profile = false;
+  bool use_jit = false;
+  size_t num_threads = 0;
+  uint64_t max_steps = UINT64_MAX;
+  bool has_max_steps = false;
+  const char *trace_path = NULL;
+  const char *symbols_path = NULL;
+  const char *out_path = NULL;
+  const char *sweep_path = NULL;
+  bool assemble = false;
+  bool pack = false;
+  bool check = false;
+  bool expect = false;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--run") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--farm") == 0) {
+      farm = true;
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      verify = true;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = ParseCount(argv[++i]);
+    } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+      max_steps = ParseCount(argv[++i]);
+      has_max_steps = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      use_jit = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+      sweep_path = argv[++i];
+    } else if (strcmp(argv[i], "--asm") == 0) {
+      assemble = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      check = true;
+    } else if (strcmp(argv[i], "--pack") == 0) {
+      pack = true;
+    } else if (strcmp(argv[i], "--expect") == 0) {
+      expect = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+      symbols_path = argv[++i];
+    } else if (argv[i][0] == '-' || path) {
+      Usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (!path) {
+    fprintf(stderr, "expected exactly one filename argument\n");
+    Usage();
+  }
+
+  if ((trace_path || profile || use_jit) && !headless) {
+    fprintf(stderr, "--jit, --trace and --profile require --run\n");
+    Usage();
+  }
+
+  // verifying keeps a hash of every so many steps of the forward run, and
+  // has to finish it before going back
+  if (verify && !has_max_steps) {
+    fprintf(stderr, "--verify requires --max-steps\n");
+    Usage();
+  }
 
-  DumpDisasm(len, input);
+  if (symbols_path && (headless || farm || verify)) {
+    fprintf(stderr, "--symbols is only used by the debugger\n");
+    Usage();
+  }
+
+  if ((assemble || pack) != (out_path != NULL)) {
+    fprintf(stderr, "--asm and --pack require -o and the other way around\n");
+    Usage();
+  }
+  if ((assemble || pack) &&
+      (headless || farm || verify || symbols_path || (assemble && pack))) {
+    fprintf(stderr, "--asm and --pack can't be used with other modes\n");
+    Usage();
+  }
+  if (expect && !pack) {
+    fprintf(stderr, "--expect requires --pack\n");
+    Usage();
+  }
+  // a rom that never halts would otherwise hang packing
+  if (expect && !has_max_steps) {
+    fprintf(stderr, "--expect requires --max-steps\n");
+    Usage();
+  }
+  if (check && (headless || farm || verify || symbols_path || assemble ||
+      pack)) {
+    fprintf(stderr, "--check can't be used with other modes\n");
+    Usage();
+  }
+  if (sweep_path && (headless || farm || verify || symbols_path || assemble ||
+      pack || check)) {
+    fprintf(stderr, "--sweep can't be used with other modes\n");
+    Usage();
+  }
+  if (sweep_path)
+    return RunSweepMode(path, sweep_path, max_steps);
+  if (check)
+    return RunCheckMode(path);
+  if (assemble)
+    return RunAsmMode(path, out_path);
+  if (pack)
+    return RunPackMode(path, out_path, expect, max_steps);
+
+  if (farm)
+    return RunFarmMode(path, num_threads, max_steps);
+  if (verify)
+    return RunVerifyMode(path, num_threads, max_steps);
+
+  static uint8_t rom[kRomMaxLen];
+  size_t len;
+  LoadRom(path, rom, &len);
 
   struct VM *vm = VMCreate();
-  memcpy(vm->memory, input, len);
+  VMWriteMemory(vm, 0, rom, len);
+
+  struct TraceWriter *trace = NULL;
+  if (trace_path) {
+    trace = TraceWriterCreate(trace_path, vm);
+    if (!trace) {
+      perror(trace_path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct Profile *prof = NULL;
+  if (profile)
+    prof = ProfileCreate(vm);
+
+  if (headless) {
+    struct Jit *jit = NULL;
+    if (use_jit) {
+      jit = JitCreate();
+      if (!jit)
+        fprintf(stderr, "jit unavailable, interpreting instead\n");
+    }
+
+    int status = RunHeadless(vm, max_steps, jit);
+    if (jit)
+      JitDestroy(jit);
+    if (trace && !TraceWriterFinish(trace, vm)) {
+      perror(trace_path);
+      status = EXIT_FAILURE;
+    }
+    if (prof) {
+      printf("\n");
+      ProfileReport(prof, stdout);
+      ProfileDestroy(prof, vm);
+    }
+    return status;
+  }
+
+  struct Symbols *syms = NULL;
+  if (symbols_path) {
+    size_t line;
+    syms = SymbolsLoad(symbols_path, &line);
+    if (!syms && errno == EINVAL) {
+      fprintf(stderr, "%s:%zu: expected an address and a name\n",
+        symbols_path, line);
+      return EXIT_FAILURE;
+    } else if (!syms) {
+      perror(symbols_path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  DumpDisasm(len, rom, syms);
 
-  struct Debugger dbg = DebuggerCreate(vm);
+  struct Debugger dbg = DebuggerCreate(vm, syms);
   RunDebugger(&dbg);
 
-  /*
-  while (!vm->err) ExecuteStep(vm);
-  fprintf(stderr, "error @ pc=0x%04x - %s\n", vm->pc, kErrorStrings[vm->err]);
-  */
   return 0;
 }
@@ -0,0 +1,113 @@
+#include "profile.h"
+
+#include "disasm.h"
+#include "involution16.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void ProfileHook(const struct VM *vm, const struct StepInfo *steps,
+    size_t count, void *ctx) {
+  (void) vm;
+  struct Profile *prof = ctx;
+
+  prof->steps += count;
+  for (size_t i = 0; i < count; i++) {
+    const struct StepInfo *step = &steps[i];
+    if (step->kind != kStepInsn) continue;
+
+    size_t slot = step->insn_addr / 2;
+    prof->hits[slot]++;
+    prof->jeq_taken[slot] += step->taken;
+    prof->op_hits[step->insn.op]++;
+    prof->insn[slot][0] = step->insn.op << 4 | step->insn.x;
+    prof->insn[slot][1] = step->insn.y << 4 | step->insn.z;
+  }
+}
+
+struct Profile *ProfileCreate(struct VM *vm) {
+  struct Profile *prof = calloc(1, sizeof(*prof));
+  Assume(prof);
+  vm->step_hook = ProfileHook;
+  vm->step_hook_ctx = prof;
+  return prof;
+}
+
+void ProfileDestroy(struct Profile *prof, struct VM *vm) {
+  if (vm->step_hook_ctx == prof) {
+    vm->step_hook = NULL;
+    vm->step_hook_ctx = NULL;
+  }
+  free(prof);
+}
+
+struct HotSlot {
+  uint64_t hits;
+  uint32_t slot;
+};
+
+// orders slots from most to least hit, then by address
+static int CompareHotSlots(const void *a, const void *b) {
+  const struct HotSlot *slot_a = a, *slot_b = b;
+  if (slot_a->hits != slot_b->hits) return slot_a->hits < slot_b->hits ? 1 : -1;
+  return (slot_a->slot > slot_b->slot) - (slot_a->slot < slot_b->slot);
+}
+
+static double Percent(uint64_t n, uint64_t total) {
+  return total ? 100.0 * n / total : 0;
+}
+
+void ProfileReport(const struct Profile *prof, FILE *out) {
+  uint64_t insns = 0;
+  for (int op = 0; op < 16; op++)
+    insns += prof->op_hits[op];
+
+  fprintf(out, "steps  %" PRIu64 "\n", prof->steps);
+  fprintf(out, "instructions  %" PRIu64 "\n\n", insns);
+
+  fprintf(out, "op   %12s  %6s\n", "count", "%");
+  for (int op = 0; op < 16; op++) {
+    if (!prof->op_hits[op]) continue;
+    fprintf(out, "%s  %12" PRIu64 "  %6.2f\n", kOpNames[op], prof->op_hits[op],
+      Percent(prof->op_hits[op], insns));
+  }
+  fprintf(out, "\n");
+
+  struct HotSlot *slots = malloc(kProfileSlots * sizeof(*slots));
+  Assume(slots);
+  size_t count = 0;
+  for (uint32_t slot = 0; slot < kProfileSlots; slot++) {
+    if (prof->hits[slot])
+      slots[count++] = (struct HotSlot) {prof->hits[slot], slot};
+  }
+  qsort(slots, count, sizeof(*slots), CompareHotSlots);
+
+  fprintf(out, "%12s  %6s  %-6s  %s\n", "hits", "%", "addr", "insn");
+  for (size_t i = 0; i < count; i++) {
+    uint32_t slot = slots[i].slot;
+    uint8_t insn[2] = {prof->insn[slot][0], prof->insn[slot][1]};
+    char str[kMaxInsnStrLen + 1];
+    InsnToStr(insn, str, NULL);
+
+    fprintf(out, "%12" PRIu64 "  %6.2f  0x%04X  ", prof->hits[slot],
+      Percent(prof->hits[slot], insns), slot * 2);
+    if (insn[0] >> 4 == kOpJeq) {
+      uint64_t taken = prof->jeq_taken[slot];
+      fprintf(out, "%-*s  taken %" PRIu64 ", not taken %" PRIu64 "\n",
+        kMaxInsnStrLen, str, taken, prof->hits[slot] - taken);
+    } else {
+      fprintf(out, "%s\n", str);
+    }
+  }
+
+  free(slots);
+}
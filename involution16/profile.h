@@ -0,0 +1,36 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "involution16.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+  // one per aligned instruction address
+  kProfileSlots = 65536 / 2,
+};
+
+// execution counts gathered through a VM's step hook
+struct Profile {
+  uint64_t steps;
+  uint64_t op_hits[16];
+  // indexed by instruction address / 2
+  uint64_t hits[kProfileSlots];
+  uint64_t jeq_taken[kProfileSlots];
+  // the instruction last executed at each address, memory can be rewritten by
+  // srm so it isn't necessarily what is there at the end of the run
+  uint8_t insn[kProfileSlots][2];
+};
+
+// creates an empty profile and installs it as vm's step hook
+struct Profile *ProfileCreate(struct VM *vm);
+// uninstalls the hook from vm if it's still installed and frees the profile
+void ProfileDestroy(struct Profile *, struct VM *vm);
+
+// writes a report to out: the opcode histogram, then every executed address
+// from most to least hit with its disassembly, and for jeq how often it was
+// taken
+void ProfileReport(const struct Profile *, FILE *out);
+
+#endif
@@ -0,0 +1,56 @@
+#include "rom.h"
+
+#include "involution16.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// roms are small enough that reading one costs less than the syscalls to find
+// out how big it is or to map it, so they're read with plain reads straight
+// into a buffer that fits any rom, with no stdio or allocation in between
+
+bool RomRead(const char *path, uint8_t *buf, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  size_t n = 0;
+  for (;;) {
+    ssize_t got;
+    if (n < kRomMaxLen) {
+      got = read(fd, buf + n, kRomMaxLen - n);
+    } else {
+      // a full buffer is only the whole rom if there's nothing after it
+      uint8_t extra;
+      got = read(fd, &extra, 1);
+      if (got > 0) {
+        close(fd);
+        errno = EFBIG;
+        return false;
+      }
+    }
+
+    if (got == 0) break;
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return false;
+    }
+    n += got;
+  }
+
+  close(fd);
+  *len = n;
+  return true;
+}
+
+struct VM *RomCreateVM(const char *path) {
+  uint8_t buf[kRomMaxLen];
+  size_t len;
+  if (!RomRead(path, buf, &len)) return NULL;
+  struct VM *vm = VMCreate();
+  VMWriteMemory(vm, 0, buf, len);
+  return vm;
+}
@@ -0,0 +1,22 @@
+#ifndef ROM_H_
+#define ROM_H_
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the largest rom that fits in VM memory
+enum {kRomMaxLen = 65536};
+
+// reads the rom file at path into buf, which must have space for kRomMaxLen
+// bytes, and stores its length in len. returns false with errno set on
+// failure, errno is EFBIG if the rom is longer than kRomMaxLen
+bool RomRead(const char *path, uint8_t *buf, size_t *len);
+
+// creates a VM with the rom file at path written to address 0. returns NULL
+// with errno set on failure, as for RomRead
+struct VM *RomCreateVM(const char *path);
+
+#endif
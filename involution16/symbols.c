@@ -0,0 +1,115 @@
+#include "symbols.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// appends name to the pool, returning its offset or 0 on failure
+static uint32_t AddName(struct Symbols *syms, size_t *cap, const char *name,
+    size_t len) {
+  if (len > kSymbolMaxLen) len = kSymbolMaxLen;
+  if (syms->names_len + len + 1 > *cap) {
+    size_t new_cap = *cap * 2;
+    while (new_cap < syms->names_len + len + 1)
+      new_cap *= 2;
+    char *names = realloc(syms->names, new_cap);
+    if (!names) return 0;
+    syms->names = names;
+    *cap = new_cap;
+  }
+
+  uint32_t offset = syms->names_len;
+  memcpy(syms->names + offset, name, len);
+  syms->names[offset + len] = '\0';
+  syms->names_len += len + 1;
+  return offset;
+}
+
+// parses one line of a symbol file into syms, returning false if it's
+// malformed
+static bool ParseLine(struct Symbols *syms, size_t *cap, char *s) {
+  while (isspace((unsigned char) *s)) s++;
+  if (*s == '\0' || *s == ';') return true;
+
+  char *end;
+  unsigned long addr = strtoul(s, &end, 0);
+  if (end == s || addr > 0xFFFF || !isspace((unsigned char) *end))
+    return false;
+
+  char *name = end;
+  while (isspace((unsigned char) *name)) name++;
+  size_t len = 0;
+  while (name[len] && !isspace((unsigned char) name[len])) len++;
+  if (len == 0) return false;
+  for (char *rest = name + len; *rest; rest++) {
+    if (!isspace((unsigned char) *rest)) return false;
+  }
+
+  if (syms->at[addr]) return true;
+  uint32_t offset = AddName(syms, cap, name, len);
+  if (!offset) return false;
+  syms->at[addr] = offset;
+  return true;
+}
+
+struct Symbols *SymbolsLoad(const char *path, size_t *line) {
+  FILE *f = fopen(path, "r");
+  if (!f) return NULL;
+
+  struct Symbols *syms = calloc(1, sizeof(*syms));
+  size_t cap = 256;
+  if (syms) syms->names = malloc(cap);
+  if (!syms || !syms->names) goto fail;
+  syms->names[0] = '\0';
+  syms->names_len = 1;
+
+  // lines longer than the buffer are malformed, as no address and name of at
+  // most kSymbolMaxLen chars needs that much
+  char buf[256];
+  *line = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    ++*line;
+    errno = 0;
+    bool whole = strchr(buf, '\n') || feof(f);
+    if (!whole || !ParseLine(syms, &cap, buf)) {
+      if (errno != ENOMEM) errno = EINVAL;
+      goto fail;
+    }
+  }
+  if (ferror(f)) goto fail;
+
+  fclose(f);
+  return syms;
+
+fail: {
+    int saved_errno = errno;
+    SymbolsDestroy(syms);
+    fclose(f);
+    errno = saved_errno;
+    return NULL;
+  }
+}
+
+void SymbolsDestroy(struct Symbols *syms) {
+  if (!syms) return;
+  free(syms->names);
+  free(syms);
+}
+
+const char *SymbolAt(const struct Symbols *syms, uint16_t addr) {
+  if (!syms || !syms->at[addr]) return NULL;
+  return syms->names + syms->at[addr];
+}
+
+bool SymbolFind(const struct Symbols *syms, const char *name, uint16_t *addr) {
+  if (!syms) return false;
+  for (size_t i = 0; i < 65536; i++) {
+    if (syms->at[i] && strcmp(syms->names + syms->at[i], name) == 0) {
+      *addr = i;
+      return true;
+    }
+  }
+  return false;
+}
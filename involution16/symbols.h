@@ -0,0 +1,42 @@
+#ifndef SYMBOLS_H_
+#define SYMBOLS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  // longest symbol name kept, longer names are cut short
+  kSymbolMaxLen = 31,
+};
+
+// names for addresses in VM memory, such as the labels of the source a rom
+// was assembled from. looking up the name at an address is a single load, so
+// the disassembler can afford it on every line it draws
+struct Symbols {
+  // offset of the name of the symbol at each address into names, or 0 where
+  // there isn't one
+  uint32_t at[65536];
+  // every name, each followed by a NUL. starts with an unused NUL so that no
+  // name is at offset 0
+  char *names;
+  size_t names_len;
+};
+
+// reads a symbol file, where each line is an address followed by a name:
+//   0x0010 loop_reenter
+// addresses are decimal, or hex with a leading 0x. blank lines and lines
+// starting with ';' are skipped, and where an address is named more than once
+// the first name is kept. returns NULL with errno set on failure, errno is
+// EINVAL and line is set to the line number if a line doesn't parse
+struct Symbols *SymbolsLoad(const char *path, size_t *line);
+void SymbolsDestroy(struct Symbols *);
+
+// the name of the symbol at addr, or NULL. syms may be NULL
+const char *SymbolAt(const struct Symbols *syms, uint16_t addr);
+
+// finds the address of the symbol with the given name, returning whether
+// there is one. syms may be NULL
+bool SymbolFind(const struct Symbols *syms, const char *name, uint16_t *addr);
+
+#endif
@@ -0,0 +1,442 @@
+#include "trace.h"
+
+#include "involution16.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static const char kTraceMagic[8] = "I16TRACE";
+
+enum {
+  kTraceVersion = 2,
+
+  kTraceHeaderLen = sizeof(kTraceMagic) + 4,
+  // first step, record count, byte count, pc, registers, page offsets
+  kTraceChunkHeaderLen = 8 + 4 + 4 + 2 + 16 * 2 + kVMPageCount * 8,
+  kTraceChunkCap = kTraceChunkHeaderLen + kTraceChunkSteps * kStepRecordMaxLen,
+  // index offset, chunk count, step count, magic
+  kTraceFooterLen = 8 + 8 + 8 + sizeof(kTraceMagic),
+};
+
+static uint8_t *Put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *Put32(uint8_t *p, uint32_t v) {
+  p = Put16(p, v);
+  return Put16(p, v >> 16);
+}
+
+static uint8_t *Put64(uint8_t *p, uint64_t v) {
+  p = Put32(p, v);
+  return Put32(p, v >> 32);
+}
+
+static uint16_t Get16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t Get32(const uint8_t *p) {
+  return Get16(p) | (uint32_t) Get16(p + 2) << 16;
+}
+
+static uint64_t Get64(const uint8_t *p) {
+  return Get32(p) | (uint64_t) Get32(p + 4) << 32;
+}
+
+static void WriteBytes(struct TraceWriter *w, const void *buf, size_t len) {
+  if (w->error) return;
+  if (fwrite(buf, 1, len, w->file) != len) {
+    w->error = errno ? errno : EIO;
+    return;
+  }
+  w->offset += len;
+}
+
+static void FlushChunk(struct TraceWriter *w) {
+  if (!w->chunk_open) return;
+  w->chunk_open = false;
+  // a keyframe taken for steps that never came
+  if (w->chunk_steps == 0) return;
+
+  // fill in the counts left blank by OpenChunk
+  Put32(w->chunk + 8, w->chunk_steps);
+  Put32(w->chunk + 12, w->chunk_len - kTraceChunkHeaderLen);
+
+  if (w->index_len == w->index_cap) {
+    w->index_cap = w->index_cap ? w->index_cap * 2 : 64;
+    w->index = realloc(w->index, w->index_cap * sizeof(*w->index));
+    Assume(w->index);
+  }
+  w->index[w->index_len++] = (struct TraceIndexEntry) {
+    .first_step = w->steps - w->chunk_steps,
+    .offset = w->offset,
+  };
+
+  WriteBytes(w, w->chunk, w->chunk_len);
+}
+
+// starts a chunk whose keyframe is the given pc and registers and vm's
+// memory, writing out the pages that changed since they were last written
+static void OpenChunk(struct TraceWriter *w, const struct VM *vm, uint16_t pc,
+    const uint16_t reg[16]) {
+  FlushChunk(w);
+
+  w->pc = pc;
+  memcpy(w->reg, reg, sizeof(w->reg));
+
+  for (size_t i = 0; i < kVMPageCount; i++) {
+    const struct VMPage *page = vm->pages[i];
+    w->stamps[i] = page->stamp;
+    if (page->stamp == w->page_stamps[i]) continue;
+    w->page_stamps[i] = page->stamp;
+    // the page every VM starts with has stamp 0
+    w->page_offsets[i] = page->stamp ? w->offset : 0;
+    if (page->stamp)
+      WriteBytes(w, page->bytes, kVMPageSize);
+  }
+
+  uint8_t *p = Put64(w->chunk, w->steps);
+  // counts are filled in by FlushChunk
+  p += 8;
+  p = Put16(p, pc);
+  for (int i = 0; i < 16; i++)
+    p = Put16(p, reg[i]);
+  for (size_t i = 0; i < kVMPageCount; i++)
+    p = Put64(p, w->page_offsets[i]);
+  w->chunk_len = p - w->chunk;
+  w->chunk_steps = 0;
+  w->chunk_open = true;
+}
+
+// whether vm's memory was written since the stamps were taken
+static bool MemoryChanged(const struct TraceWriter *w, const struct VM *vm) {
+  for (size_t i = 0; i < kVMPageCount; i++) {
+    if (vm->pages[i]->stamp != w->stamps[i]) return true;
+  }
+  return false;
+}
+
+static void TraceLog(const struct VM *vm, const struct StepRecords *steps,
+    void *ctx) {
+  struct TraceWriter *w = ctx;
+
+  // a run is about to start. if the VM was changed since the last batch, the
+  // reader needs a keyframe of it as it is now to follow on
+  if (steps->count == 0) {
+    if (!w->chunk_open || w->pc != steps->pc_before ||
+        memcmp(w->reg, steps->reg_before, sizeof(w->reg)) != 0 ||
+        MemoryChanged(w, vm))
+      OpenChunk(w, vm, steps->pc_before, steps->reg_before);
+    return;
+  }
+
+  memcpy(w->chunk + w->chunk_len, steps->data, steps->len);
+  w->chunk_len += steps->len;
+  w->chunk_steps += steps->count;
+  w->steps += steps->count;
+
+  w->pc = steps->pc_after;
+  memcpy(w->reg, vm->reg, sizeof(w->reg));
+  for (size_t i = 0; i < kVMPageCount; i++)
+    w->stamps[i] = vm->pages[i]->stamp;
+
+  // vm only holds the state before a step between batches, so a chunk that
+  // might not fit the next batch ends here
+  if (w->chunk_steps + kStepLogBatch > kTraceChunkSteps)
+    OpenChunk(w, vm, w->pc, w->reg);
+}
+
+struct TraceWriter *TraceWriterCreate(const char *path, struct VM *vm) {
+  FILE *file = fopen(path, "wb");
+  if (!file) return NULL;
+
+  struct TraceWriter *w = calloc(1, sizeof(*w));
+  Assume(w);
+  w->file = file;
+  w->chunk = malloc(kTraceChunkCap);
+  Assume(w->chunk);
+
+  uint8_t header[kTraceHeaderLen];
+  memcpy(header, kTraceMagic, sizeof(kTraceMagic));
+  Put32(header + sizeof(kTraceMagic), kTraceVersion);
+  WriteBytes(w, header, sizeof(header));
+  OpenChunk(w, vm, vm->pc, vm->reg);
+
+  vm->step_log = TraceLog;
+  vm->step_log_ctx = w;
+  return w;
+}
+
+bool TraceWriterFinish(struct TraceWriter *w, struct VM *vm) {
+  if (vm->step_log_ctx == w) {
+    vm->step_log = NULL;
+    vm->step_log_ctx = NULL;
+  }
+
+  FlushChunk(w);
+
+  uint64_t index_offset = w->offset;
+  for (size_t i = 0; i < w->index_len; i++) {
+    uint8_t entry[16];
+    Put64(entry, w->index[i].first_step);
+    Put64(entry + 8, w->index[i].offset);
+    WriteBytes(w, entry, sizeof(entry));
+  }
+
+  uint8_t footer[kTraceFooterLen];
+  uint8_t *p = Put64(footer, index_offset);
+  p = Put64(p, w->index_len);
+  p = Put64(p, w->steps);
+  memcpy(p, kTraceMagic, sizeof(kTraceMagic));
+  WriteBytes(w, footer, sizeof(footer));
+
+  if (fclose(w->file) != 0 && !w->error)
+    w->error = errno;
+
+  int error = w->error;
+  free(w->index);
+  free(w->chunk);
+  free(w);
+
+  errno = error;
+  return !error;
+}
+
+static bool LoadChunk(struct TraceReader *r, size_t chunk) {
+  uint8_t header[kTraceChunkHeaderLen];
+  if (fseek(r->file, r->index[chunk].offset, SEEK_SET) != 0 ||
+      fread(header, 1, sizeof(header), r->file) != sizeof(header))
+    goto corrupt;
+
+  uint64_t first_step = Get64(header);
+  uint32_t count = Get32(header + 8);
+  uint32_t len = Get32(header + 12);
+  if (first_step != r->index[chunk].first_step || count == 0 ||
+      count > kTraceChunkSteps || len > (size_t) count * kStepRecordMaxLen)
+    goto corrupt;
+
+  if (len > r->data_cap) {
+    r->data_cap = len;
+    r->data = realloc(r->data, r->data_cap);
+    Assume(r->data);
+  }
+  if (fread(r->data, 1, len, r->file) != len)
+    goto corrupt;
+
+  // load the pages of the keyframe that memory doesn't already hold
+  for (size_t i = 0; i < kVMPageCount; i++) {
+    uint64_t offset = Get64(header + 50 + i * 8);
+    if (offset == r->page_offsets[i]) continue;
+    uint8_t *page = r->mem + i * kVMPageSize;
+    if (offset == 0) {
+      memset(page, kOpBrk << 4 | 0xF, kVMPageSize);
+    } else if (offset < kTraceHeaderLen ||
+        offset + kVMPageSize > r->index[chunk].offset ||
+        fseek(r->file, offset, SEEK_SET) != 0 ||
+        fread(page, 1, kVMPageSize, r->file) != kVMPageSize) {
+      goto corrupt;
+    }
+    r->page_offsets[i] = offset;
+  }
+
+  r->chunk = chunk;
+  r->data_len = len;
+  r->pos = 0;
+  r->next_step = first_step;
+  r->chunk_remaining = count;
+  r->pc = Get16(header + 16);
+  for (int i = 0; i < 16; i++)
+    r->reg[i] = Get16(header + 18 + i * 2);
+  return true;
+
+corrupt:
+  r->chunk_remaining = 0;
+  // memory may be partly loaded
+  memset(r->page_offsets, 0xFF, sizeof(r->page_offsets));
+  errno = EINVAL;
+  return false;
+}
+
+struct TraceReader *TraceOpen(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return NULL;
+
+  struct TraceReader *r = calloc(1, sizeof(*r));
+  Assume(r);
+  r->file = file;
+  // nothing is loaded yet
+  memset(r->page_offsets, 0xFF, sizeof(r->page_offsets));
+
+  uint8_t header[kTraceHeaderLen];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+      Get32(header + sizeof(kTraceMagic)) != kTraceVersion)
+    goto corrupt;
+
+  uint8_t footer[kTraceFooterLen];
+  if (fseek(file, -(long) sizeof(footer), SEEK_END) != 0)
+    goto corrupt;
+  long footer_offset = ftell(file);
+  if (footer_offset < 0 ||
+      fread(footer, 1, sizeof(footer), file) != sizeof(footer) ||
+      memcmp(footer + 24, kTraceMagic, sizeof(kTraceMagic)) != 0)
+    goto corrupt;
+
+  uint64_t index_offset = Get64(footer);
+  r->chunk_count = Get64(footer + 8);
+  r->steps = Get64(footer + 16);
+  if (index_offset > (uint64_t) footer_offset ||
+      r->chunk_count != ((uint64_t) footer_offset - index_offset) / 16)
+    goto corrupt;
+
+  r->index = malloc((r->chunk_count + 1) * sizeof(*r->index));
+  Assume(r->index);
+  if (fseek(file, index_offset, SEEK_SET) != 0)
+    goto corrupt;
+  for (size_t i = 0; i < r->chunk_count; i++) {
+    uint8_t entry[16];
+    if (fread(entry, 1, sizeof(entry), file) != sizeof(entry))
+      goto corrupt;
+    r->index[i].first_step = Get64(entry);
+    r->index[i].offset = Get64(entry + 8);
+  }
+
+  if (r->chunk_count > 0 && !LoadChunk(r, 0))
+    goto corrupt;
+  return r;
+
+corrupt:
+  TraceClose(r);
+  errno = EINVAL;
+  return NULL;
+}
+
+void TraceClose(struct TraceReader *r) {
+  fclose(r->file);
+  free(r->index);
+  free(r->data);
+  free(r);
+}
+
+bool TraceSeek(struct TraceReader *r, uint64_t step) {
+  if (step >= r->steps || r->chunk_count == 0) return false;
+
+  // find the last chunk starting at or before step
+  size_t lo = 0, hi = r->chunk_count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (r->index[mid].first_step <= step)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  // carry on from the current position if it's already on the way
+  bool on_the_way = r->chunk == lo && r->next_step <= step &&
+    r->chunk_remaining > 0;
+  if (!on_the_way && !LoadChunk(r, lo))
+    return false;
+
+  struct TraceRecord rec;
+  while (r->next_step < step) {
+    if (!TraceNext(r, &rec)) return false;
+  }
+  return r->next_step == step && r->chunk_remaining > 0;
+}
+
+bool TraceNext(struct TraceReader *r, struct TraceRecord *rec) {
+  if (r->chunk_remaining == 0) {
+    if (r->chunk + 1 >= r->chunk_count) return false;
+    if (!LoadChunk(r, r->chunk + 1)) return false;
+  }
+
+  const uint8_t *p = r->data + r->pos;
+  const uint8_t *end = r->data + r->data_len;
+  if (p == end) goto corrupt;
+  uint8_t flags = *p++;
+
+  *rec = (struct TraceRecord) {
+    .step = r->next_step,
+    .kind = flags & kStepRecordLeaveBrk ? kStepLeaveBrk : kStepInsn,
+    .direction = flags & kStepRecordBackward ?
+      kExecutingBackward : kExecutingForward,
+    .pc = r->pc,
+  };
+
+  if (rec->kind == kStepLeaveBrk) {
+    rec->next_pc = rec->pc + sizeof(uint16_t) * rec->direction;
+  } else {
+    rec->insn_addr = rec->direction == kExecutingBackward ?
+      rec->pc - 2 : rec->pc;
+    // the instruction in the aligned slot, as the VM fetches it
+    memcpy(rec->insn, r->mem + (rec->insn_addr & ~1), 2);
+    struct DecodedInsn insn = {
+      rec->insn[0] >> 4,
+      rec->insn[0] & 0xF,
+      rec->insn[1] >> 4,
+      rec->insn[1] & 0xF,
+    };
+    rec->decoded = insn;
+
+    if (end - p < 2) goto corrupt;
+    uint16_t dx = Get16(p), dy = 0;
+    p += 2;
+    if (flags & kStepRecordY) {
+      if (end - p < 2) goto corrupt;
+      dy = Get16(p);
+      p += 2;
+    }
+
+    rec->x_old = r->reg[insn.x];
+    rec->y_old = r->reg[insn.y];
+    rec->x_new = rec->x_old ^ dx;
+    rec->y_new = insn.y == insn.x ? rec->x_new : rec->y_old ^ dy;
+
+    rec->next_pc = rec->direction == kExecutingBackward ?
+      rec->insn_addr : rec->insn_addr + 2;
+    if (insn.op == kOpJeq && r->reg[insn.y] == r->reg[insn.z]) {
+      // the jump swaps pc with the target, then pc moves on as usual
+      rec->taken = true;
+      rec->next_pc = rec->direction == kExecutingBackward ?
+        rec->x_old : rec->x_old + 2;
+    } else if (insn.op == kOpSrm) {
+      rec->mem_write = true;
+      rec->mem_addr = rec->y_old;
+      rec->mem_old = rec->x_new;
+      rec->mem_new = rec->x_old;
+      uint16_t addrs[2] = {rec->mem_addr, rec->mem_addr + 1};
+      for (int i = 0; i < 2; i++) {
+        r->mem[addrs[i]] = rec->mem_new >> i * 8;
+        // the page no longer matches any in the file
+        r->page_offsets[addrs[i] / kVMPageSize] = UINT64_MAX;
+      }
+    }
+
+    r->reg[insn.y] = rec->y_new;
+    r->reg[insn.x] = rec->x_new;
+  }
+
+  r->pc = rec->next_pc;
+  r->pos = p - r->data;
+  r->next_step++;
+  r->chunk_remaining--;
+  return true;
+
+corrupt:
+  r->chunk_remaining = 0;
+  errno = EINVAL;
+  return false;
+}
@@ -0,0 +1,134 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// a trace is a record of every step a VM took, written by a TraceWriter
+// installed as the VM's step log. the file is a header, then a sequence of
+// chunks, then an index of the chunks and a footer:
+//
+//   header  "I16TRACE", version
+//   page    kVMPageSize bytes of memory, written ahead of the first chunk
+//           whose keyframe holds them
+//   chunk   first step, record count, byte count, pc and registers before
+//           the first step, the file offset of every page of memory then
+//           (0 for a page filled with brk), then the records
+//   index   first step and file offset of every chunk
+//   footer  index offset, chunk count, step count, "I16TRACE"
+//
+// all integers are little endian. records are as the VM logs them (see
+// StepRecords). everything else (the instruction, pc, memory written by srm,
+// jump targets) follows from the state before the step, which the reader
+// tracks from the chunk's keyframe
+
+enum {
+  // most records per chunk, and so the most records read to seek to any step
+  kTraceChunkSteps = 1 << 16,
+};
+
+struct TraceIndexEntry {
+  uint64_t first_step;
+  uint64_t offset;
+};
+
+struct TraceWriter {
+  FILE *file;
+  // bytes written to file so far
+  uint64_t offset;
+  // errno of the first failed write, reported by TraceWriterFinish
+  int error;
+  uint64_t steps;
+
+  // the pc, registers and page stamps as of the last record. if the next
+  // run doesn't start from them (the VM was modified between runs), a new
+  // chunk is started
+  uint16_t pc;
+  uint16_t reg[16];
+  uint64_t stamps[kVMPageCount];
+
+  // the stamp and file offset of the copy of each page written last
+  uint64_t page_stamps[kVMPageCount];
+  uint64_t page_offsets[kVMPageCount];
+
+  // the chunk being built, flushed before it would grow past
+  // kTraceChunkSteps records
+  uint8_t *chunk;
+  size_t chunk_len;
+  uint32_t chunk_steps;
+  bool chunk_open;
+
+  struct TraceIndexEntry *index;
+  size_t index_len, index_cap;
+};
+
+// creates a trace at path and installs it as vm's step log. returns NULL
+// with errno set if the file can't be created
+struct TraceWriter *TraceWriterCreate(const char *path, struct VM *vm);
+// uninstalls the log from vm, writes out the rest of the trace and closes
+// it. returns false with errno set if writing the trace failed
+bool TraceWriterFinish(struct TraceWriter *, struct VM *vm);
+
+// a decoded step
+struct TraceRecord {
+  uint64_t step;
+  StepKind kind;
+  ExecutionDirection direction;
+  // pc before and after the step
+  uint16_t pc, next_pc;
+
+  // the rest is only set for kStepInsn
+  uint16_t insn_addr;
+  uint8_t insn[2];
+  struct DecodedInsn decoded;
+  uint16_t x_old, x_new;
+  uint16_t y_old, y_new;
+  // whether a jeq jumped
+  bool taken;
+  // whether the step was an srm, which swapped the two bytes at mem_addr
+  // and mem_addr + 1 (wrapping) from mem_old to mem_new
+  bool mem_write;
+  uint16_t mem_addr;
+  uint16_t mem_old, mem_new;
+};
+
+struct TraceReader {
+  FILE *file;
+  uint64_t steps;
+  struct TraceIndexEntry *index;
+  size_t chunk_count;
+
+  // the chunk being read and the position of the next record in it
+  size_t chunk;
+  uint8_t *data;
+  size_t data_len, data_cap;
+  size_t pos;
+  uint64_t next_step;
+  uint32_t chunk_remaining;
+
+  // pc and registers after the last record returned by TraceNext, or before
+  // the step seeked to
+  uint16_t pc;
+  uint16_t reg[16];
+  // memory likewise, and the file offset each page was loaded from, or
+  // UINT64_MAX if it wasn't or has been written since
+  uint8_t mem[0x10000];
+  uint64_t page_offsets[kVMPageCount];
+};
+
+// opens the trace at path, returns NULL with errno set on failure, EINVAL
+// if the file isn't a valid trace
+struct TraceReader *TraceOpen(const char *path);
+void TraceClose(struct TraceReader *);
+// positions the reader so that the next call to TraceNext returns the given
+// step. returns false if the trace has no such step
+bool TraceSeek(struct TraceReader *, uint64_t step);
+// decodes the next record, returns false at the end of the trace or if the
+// trace is corrupt (errno is set to EINVAL for the latter)
+bool TraceNext(struct TraceReader *, struct TraceRecord *);
+
+#endif
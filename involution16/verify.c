@@ -0,0 +1,217 @@
+#include "verify.h"
+
+#include "corpus.h"
+#include "disasm.h"
+#include "farm.h"
+#include "involution16.h"
+#include "rom.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xxhash.h>
+
+enum {
+  // steps between the hashes taken on the first forward run
+  kVerifyInterval = 1 << 16,
+  // number of pieces a failing window is split into on each narrowing pass
+  kVerifySplit = 64,
+};
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// hashes everything that makes up a VM's state except the direction, which
+// necessarily differs between the forward and backward runs
+static XXH128_hash_t StateHash(struct VM *vm) {
+  struct VMHash mem = VMMemoryHash(vm);
+
+  XXH3_state_t *state = XXH3_createState();
+  Assume(state);
+  XXH3_128bits_reset(state);
+
+  XXH3_128bits_update(state, vm->reg, sizeof(vm->reg));
+  XXH3_128bits_update(state, &vm->pc, sizeof(vm->pc));
+  XXH3_128bits_update(state, &vm->brk_dir, sizeof(vm->brk_dir));
+  XXH3_128bits_update(state, &vm->err, sizeof(vm->err));
+  XXH3_128bits_update(state, &mem, sizeof(mem));
+
+  XXH128_hash_t hash = XXH3_128bits_digest(state);
+  XXH3_freeState(state);
+  return hash;
+}
+
+// steps vm backward n steps and checks that it ends up in the state with the
+// given hash
+static bool ReverseMatches(struct VM *vm, uint64_t n, XXH128_hash_t expected) {
+  vm->direction = kExecutingBackward;
+  // a brk or an error on the way back stops the run short
+  if (ExecuteRun(vm, n) != n || vm->err)
+    return false;
+  return XXH128_isEqual(StateHash(vm), expected);
+}
+
+// narrows down a window of steps [lo, hi] known to reverse incorrectly to the
+// last step in it that reverses incorrectly. lo_snap is the forward state at lo and
+// is destroyed by this function
+static void Pinpoint(struct VM *vm, struct VMSnapshot *lo_snap, uint64_t lo,
+    uint64_t hi, struct VerifyResult *res) {
+  struct VMSnapshot *snaps[kVerifySplit + 1];
+  XXH128_hash_t hashes[kVerifySplit + 1];
+  uint64_t pos[kVerifySplit + 1];
+
+  while (hi - lo > 1) {
+    uint64_t span = (hi - lo + kVerifySplit - 1) / kVerifySplit;
+
+    VMRestore(vm, lo_snap);
+    vm->direction = kExecutingForward;
+    size_t count = 0;
+    pos[count] = lo;
+    hashes[count] = StateHash(vm);
+    snaps[count++] = lo_snap;
+    while (pos[count-1] < hi) {
+      uint64_t n = hi - pos[count-1] < span ? hi - pos[count-1] : span;
+      uint64_t ran = ExecuteRun(vm, n);
+      assert(ran == n);
+      pos[count] = pos[count-1] + ran;
+      hashes[count] = StateHash(vm);
+      snaps[count++] = VMSnapshot(vm);
+    }
+
+    // walk back down from hi, the first checkpoint to mismatch bounds the
+    // highest step that reverses incorrectly
+    size_t bad = 0;
+    for (size_t i = count - 1; i > 0; i--) {
+      if (!ReverseMatches(vm, pos[i] - pos[i-1], hashes[i-1])) {
+        bad = i;
+        break;
+      }
+    }
+
+    // every piece reversed fine on its own, so the steps only misbehave when
+    // reversed as a whole and this window is as close as it gets
+    if (bad == 0) {
+      for (size_t i = 1; i < count; i++) VMSnapshotDestroy(snaps[i]);
+      break;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      if (i != bad - 1) VMSnapshotDestroy(snaps[i]);
+    }
+    lo_snap = snaps[bad - 1];
+    lo = pos[bad - 1];
+    hi = pos[bad];
+  }
+
+  res->diverged = true;
+  res->divergent_step = lo;
+  res->divergent_pc = lo_snap->state.pc;
+  VMReadMemory(&lo_snap->state, res->divergent_pc, res->divergent_insn, 2);
+  VMSnapshotDestroy(lo_snap);
+}
+
+struct VerifyResult VerifyReversal(struct VM *vm, uint64_t max_steps) {
+  struct VerifyResult res = {0};
+  struct VMSnapshot *start = VMSnapshot(vm);
+
+  // hashes[i] is the hash of the state after i * kVerifyInterval steps
+  size_t count = 0, cap = 64;
+  XXH128_hash_t *hashes = malloc(cap * sizeof(*hashes));
+  Assume(hashes);
+
+  vm->direction = kExecutingForward;
+  hashes[count++] = StateHash(vm);
+  uint64_t n = 0;
+  while (n < max_steps) {
+    uint64_t chunk = max_steps - n < kVerifyInterval ? max_steps - n : kVerifyInterval;
+    uint64_t ran = ExecuteRun(vm, chunk);
+    n += ran;
+    if (ran < chunk || n == max_steps) break;
+
+    if (count == cap) {
+      cap *= 2;
+      hashes = realloc(hashes, cap * sizeof(*hashes));
+      Assume(hashes);
+    }
+    hashes[count++] = StateHash(vm);
+  }
+  res.steps = n;
+
+  // the instruction that raised the error was never executed, so there's
+  // nothing to undo for it
+  vm->err = kErrorNone;
+
+  uint64_t hi = n;
+  for (size_t i = count; i-- > 0;) {
+    uint64_t lo = i * (uint64_t) kVerifyInterval;
+    if (!ReverseMatches(vm, hi - lo, hashes[i])) {
+      VMRestore(vm, start);
+      vm->direction = kExecutingForward;
+      ExecuteRun(vm, lo);
+      Pinpoint(vm, VMSnapshot(vm), lo, hi, &res);
+      break;
+    }
+    hi = lo;
+  }
+
+  free(hashes);
+  VMSnapshotDestroy(start);
+  return res;
+}
+
+// verifies vm, destroys it and writes the result line for it
+static size_t ReportVerify(struct VerifyFarmCtx *ctx, const char *name,
+    int name_len, struct VM *vm, char *line) {
+  struct VerifyResult res = VerifyReversal(vm, ctx->max_steps);
+  VMDestroy(vm);
+
+  if (!res.diverged) {
+    return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen,
+      "%.*s\tok\t%" PRIu64 "\n", name_len, name, res.steps));
+  }
+
+  atomic_fetch_add(&ctx->failures, 1);
+
+  char disasm[kMaxInsnStrLen + 1];
+  disasm[InsnToStr(res.divergent_insn, disasm, NULL)] = '\0';
+
+  return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen,
+    "%.*s\tdiverged\t%" PRIu64 "\t%" PRIu64 "\t%04X\t%s\n", name_len, name,
+    res.steps, res.divergent_step, res.divergent_pc, disasm));
+}
+
+size_t FarmVerifyRom(const char *path, void *ctx_ptr, char *line) {
+  struct VerifyFarmCtx *ctx = ctx_ptr;
+
+  struct VM *vm = RomCreateVM(path);
+  if (!vm) {
+    atomic_fetch_add(&ctx->failures, 1);
+    return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen,
+      "%s\tload\t%s\n", path, strerror(errno)));
+  }
+  return ReportVerify(ctx, path, strlen(path), vm, line);
+}
+
+size_t FarmVerifyCorpusEntry(size_t index, void *ctx_ptr, char *line) {
+  struct VerifyFarmCtx *ctx = ctx_ptr;
+
+  struct CorpusEntry e;
+  if (!CorpusGet(ctx->corpus, index, &e)) {
+    atomic_fetch_add(&ctx->failures, 1);
+    return FarmFinishLine(line, snprintf(line, kFarmMaxLineLen,
+      "%s:%zu\tload\t%s\n", ctx->path, index, strerror(errno)));
+  }
+
+  char buf[kFarmMaxLineLen];
+  const char *name;
+  int name_len = FarmEntryName(ctx->path, index, &e, buf, &name);
+  return ReportVerify(ctx, name, name_len, CorpusCreateVM(&e), line);
+}
@@ -0,0 +1,51 @@
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include "corpus.h"
+#include "involution16.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct VerifyResult {
+  // steps executed forwards, fewer than requested if a brk or error stopped
+  // the run early
+  uint64_t steps;
+  bool diverged;
+  // when diverged, the last step (counting from 0 at the starting state)
+  // whose reversal didn't reproduce the forward state, which is the first
+  // the backward run comes to, and the address of the instruction executed
+  // by it
+  uint64_t divergent_step;
+  uint16_t divergent_pc;
+  uint8_t divergent_insn[2];
+};
+
+// runs vm forward for up to max_steps, then backward over the same steps,
+// checking that every state on the way back matches the state on the way out.
+// states are compared by hash at evenly spaced checkpoints, and a mismatch is
+// narrowed down to a single step by replaying the failing window. vm is left
+// in an unspecified state
+struct VerifyResult VerifyReversal(struct VM *vm, uint64_t max_steps);
+
+struct VerifyFarmCtx {
+  uint64_t max_steps;
+  // incremented for every rom that diverged or failed to load
+  _Atomic size_t failures;
+  // for FarmVerifyCorpusEntry, the corpus and the path it was opened from
+  const struct CorpusReader *corpus;
+  const char *path;
+};
+
+// FarmJobFn taking a struct VerifyFarmCtx, reports tab separated fields:
+//   path, status (ok or diverged), steps
+// followed for diverged roms by the divergent step, its pc and disassembly.
+// roms that fail to load are reported as just path, "load", and the reason
+size_t FarmVerifyRom(const char *path, void *ctx, char *line);
+// FarmItemFn verifying an entry of ctx's corpus from its start state, named
+// as by FarmRunCorpusEntry and reported as by FarmVerifyRom
+size_t FarmVerifyCorpusEntry(size_t index, void *ctx, char *line);
+
+#endif
@@ -0,0 +1,248 @@
+#include "wide.h"
+
+#include "involution16.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// one register of every lane
+typedef uint16_t Lanes __attribute__((vector_size(2 * kWideLanes)));
+
+// a vector of lanes fits in one avx2 register, but takes two sse ones and
+// leaves variable shifts to scalar code. where the loader can pick between
+// versions of a function, lockstep execution gets an avx2 version too
+#if defined(__x86_64__) && defined(__linux__)
+#define WIDE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define WIDE_TARGETS
+#endif
+
+static void Assume(bool cond) {
+  if (!cond) {
+    perror("error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct WideVM *WideVMCreate(const struct VM *vm) {
+  struct WideVM *wide = malloc(sizeof(*wide));
+  Assume(wide);
+  for (size_t i = 0; i < kWideLanes; i++) {
+    wide->lanes[i] = VMFork(vm);
+    wide->steps[i] = 0;
+  }
+  return wide;
+}
+
+void WideVMDestroy(struct WideVM *wide) {
+  for (size_t i = 0; i < kWideLanes; i++)
+    VMDestroy(wide->lanes[i]);
+  free(wide);
+}
+
+// for masks produced by comparing Lanes, where each lane is 0 or 0xFFFF
+static bool AllLanes(const Lanes *mask) {
+  for (size_t i = 0; i < kWideLanes; i++) {
+    if (!(*mask)[i]) return false;
+  }
+  return true;
+}
+
+static bool AnyLane(const Lanes *mask) {
+  for (size_t i = 0; i < kWideLanes; i++) {
+    if ((*mask)[i]) return true;
+  }
+  return false;
+}
+
+// whether every lane has the same two bytes at addr as the first one
+static bool SameBytes(const struct WideVM *wide, uint16_t addr) {
+  uint8_t first[2], bytes[2];
+  VMReadMemory(wide->lanes[0], addr, first, 2);
+  for (size_t i = 1; i < kWideLanes; i++) {
+    VMReadMemory(wide->lanes[i], addr, bytes, 2);
+    if (memcmp(first, bytes, 2) != 0) return false;
+  }
+  return true;
+}
+
+// whether a jeq at the aligned addr can jump to target in every lane. shared
+// is whether every lane is known to have the same memory
+static bool CanJump(const struct WideVM *wide, bool shared, uint16_t addr,
+    uint16_t target) {
+  if (target & 1) return false;
+
+  size_t lanes = shared ? 1 : kWideLanes;
+  for (size_t i = 0; i < lanes; i++) {
+    uint8_t from[2], to[2];
+    VMReadMemory(wide->lanes[i], addr, from, 2);
+    VMReadMemory(wide->lanes[i], target, to, 2);
+    if (memcmp(from, to, 2) != 0) return false;
+  }
+  return true;
+}
+
+// runs the lanes together for as long as they stay in lockstep, and returns
+// the steps they all took. stops before the first step that the lanes don't
+// agree on, with every lane's state written back
+WIDE_TARGETS static uint64_t RunLockstep(struct WideVM *wide, uint64_t max_steps) {
+  struct VM *first = wide->lanes[0];
+  // odd pcs fetch differently from their jeq checks, and are left to the
+  // interpreter
+  if (first->err || first->pc & 1) return 0;
+  for (size_t i = 0; i < kWideLanes; i++) {
+    const struct VM *vm = wide->lanes[i];
+    if (vm->err || vm->step_hook || vm->step_log || vm->pc != first->pc ||
+        vm->direction != first->direction || vm->brk_dir != first->brk_dir)
+      return 0;
+  }
+  if (first->brk_dir == first->direction || max_steps == 0) return 0;
+
+  uint64_t steps = 0;
+  if (first->brk_dir) {
+    // stepping off of a brk takes a step of its own
+    for (size_t i = 0; i < kWideLanes; i++)
+      ExecuteStep(wide->lanes[i]);
+    steps++;
+  }
+
+  // lanes created by WideVMCreate share every page until one of them is
+  // written to. after that, code has to be compared before it's executed
+  bool shared = true;
+  for (size_t i = 1; i < kWideLanes && shared; i++) {
+    shared = memcmp(first->pages, wide->lanes[i]->pages,
+      sizeof(first->pages)) == 0;
+  }
+
+  Lanes reg[16];
+  for (size_t r = 0; r < 16; r++) {
+    for (size_t i = 0; i < kWideLanes; i++)
+      reg[r][i] = wide->lanes[i]->reg[r];
+  }
+  uint16_t pc = first->pc;
+  bool brk = false;
+
+  const uint16_t pc_pre = first->direction == kExecutingBackward ? -2 : 0;
+  const uint16_t pc_post = first->direction == kExecutingForward ? 2 : 0;
+
+  while (steps < max_steps) {
+    pc += pc_pre;
+    if (!shared && !SameBytes(wide, pc)) goto diverge;
+
+    const struct VMPage *page = first->pages[pc / kVMPageSize];
+    struct DecodedInsn insn = page->decoded[pc % kVMPageSize / 2];
+    Lanes *x = &reg[insn.x];
+    Lanes y = reg[insn.y];
+    Lanes z = reg[insn.z];
+
+    switch (insn.op) {
+      case kOpAdd:
+        *x ^= y + z;
+        break;
+      case kOpSub:
+        *x ^= y - z;
+        break;
+      // rotating a 16 bit value within 32 bits and truncating is a shift
+      case kOpRor:
+      case kOpShr:
+        *x ^= y >> (z & 0xF);
+        break;
+      case kOpRol:
+      case kOpShl:
+        *x ^= y << (z & 0xF);
+        break;
+      case kOpAnd:
+        *x ^= y & z;
+        break;
+      case kOpOra:
+        *x ^= y | z;
+        break;
+      case kOpMul:
+        *x ^= y * z;
+        break;
+      case kOpDiv: {
+        // lanes dividing by 0 divide by 1 instead, then are masked out
+        Lanes nonzero = (Lanes) (z != 0);
+        *x ^= y / (z | (~nonzero & 1)) & nonzero;
+        break;
+      }
+      case kOpCmp:
+        *x ^= (Lanes) (y < z) | ((Lanes) (y > z) & 1);
+        break;
+      case kOpJeq: {
+        Lanes taken = (Lanes) (y == z);
+        if (!AnyLane(&taken)) break;
+
+        uint16_t target = (*x)[0];
+        Lanes same_target = (Lanes) (*x == target);
+        if (!AllLanes(&taken) || !AllLanes(&same_target) ||
+            !CanJump(wide, shared, pc, target))
+          goto diverge;
+        *x = (Lanes) {} + pc;
+        pc = target;
+        break;
+      }
+      case kOpXri:
+        *x ^= (uint16_t) ((insn.y << 4) | insn.z);
+        break;
+      case kOpSrr: {
+        if (insn.z >= kSrrCodeCount) goto diverge;
+
+        // bytes numbered as for PermuteRegs
+        Lanes bytes[4] = {*x & 0xFF, *x >> 8, y & 0xFF, y >> 8};
+        const uint8_t *perm = kSrrCodes[insn.z];
+        *x = bytes[perm[0]] | bytes[perm[1]] << 8;
+        reg[insn.y] = bytes[perm[2]] | bytes[perm[3]] << 8;
+        break;
+      }
+      case kOpSrm:
+        // each lane swaps with its own memory, which may then differ
+        for (size_t i = 0; i < kWideLanes; i++) {
+          struct VM *vm = wide->lanes[i];
+          uint16_t addr = y[i];
+          uint8_t bytes_old[2] = {
+            VMReadByte(vm, addr),
+            VMReadByte(vm, addr + 1)
+          };
+          uint8_t bytes_new[2] = {(*x)[i], (*x)[i] >> 8};
+          // one byte at a time, as the second wraps around at the end of
+          // memory
+          VMWriteMemory(vm, addr, &bytes_new[0], 1);
+          VMWriteMemory(vm, addr + 1, &bytes_new[1], 1);
+          (*x)[i] = bytes_old[0] | bytes_old[1] << 8;
+        }
+        shared = false;
+        break;
+      case kOpBrk:
+        brk = true;
+        break;
+    }
+
+    pc += pc_post;
+    steps++;
+    if (brk) break;
+    continue;
+
+diverge:
+    pc -= pc_pre;
+    break;
+  }
+
+  for (size_t i = 0; i < kWideLanes; i++) {
+    struct VM *vm = wide->lanes[i];
+    for (size_t r = 0; r < 16; r++)
+      vm->reg[r] = reg[r][i];
+    vm->pc = pc;
+    if (brk) vm->brk_dir = vm->direction;
+  }
+  return steps;
+}
+
+void WideRun(struct WideVM *wide, uint64_t max_steps) {
+  uint64_t steps = RunLockstep(wide, max_steps);
+  for (size_t i = 0; i < kWideLanes; i++) {
+    wide->steps[i] = steps + ExecuteRun(wide->lanes[i], max_steps - steps);
+  }
+}
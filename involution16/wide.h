@@ -0,0 +1,35 @@
+#ifndef WIDE_H_
+#define WIDE_H_
+
+#include "involution16.h"
+
+#include <stdint.h>
+
+enum {
+  // VMs run side by side by a WideVM
+  kWideLanes = 16,
+};
+
+// a group of VMs that execute in lockstep, for running one rom over many
+// starting states. while every lane is at the same pc with the same code the
+// registers of all lanes are kept in vectors and each instruction is executed
+// for every lane at once. once the lanes diverge, on a jeq that jumps for
+// only some of them or anything else that would leave them in different
+// states, each lane carries on alone as with ExecuteRun
+struct WideVM {
+  // owned by the WideVM. between runs the lanes are ordinary VMs, and may be
+  // inspected and modified freely
+  struct VM *lanes[kWideLanes];
+  // steps retired by each lane in the last run
+  uint64_t steps[kWideLanes];
+};
+
+// every lane starts out as a fork of vm
+struct WideVM *WideVMCreate(const struct VM *vm);
+void WideVMDestroy(struct WideVM *);
+
+// runs every lane as ExecuteRun(lane, max_steps) would, recording the steps
+// each lane took in steps
+void WideRun(struct WideVM *, uint64_t max_steps);
+
+#endif
@@ -60,6 +60,8 @@ struct UTuiOutput {
 struct UTuiOutput UTuiOutput_Init(void);
 void UTuiOutput_Destroy(struct UTuiOutput *);
 
+// clears the screen, and forgets what was on it so every line set afterwards
+// is redrawn
 void UTuiOutput_Resize(struct UTuiOutput *, size_t num_cols, size_t num_rows);
 
 // sets the line of text at row y to the given n byte long string with the given style information per byte
@@ -95,6 +97,10 @@ enum {
   kUTuiPageUp,
   kUTuiPageDown,
 
+  // not a key, returned when the terminal has been resized since the last
+  // read
+  kUTuiResize,
+
   // used to denote no available key
   kUTuiKeyNone,
   // used to denote an error reading
@@ -113,12 +119,15 @@ enum {kUTuiMaxInputSeq = 6};
 struct UTuiInput {
   char seq[kUTuiMaxInputSeq];
   uint8_t seq_cnt;
+  bool resized;
   UTuiInputError error;
 };
 
+// also installs a SIGWINCH handler, which wakes up UTuiInput_ReadKey through a
+// pipe when the terminal is resized
 struct UTuiInput UTuiInput_Init(void);
 // polls stdin for timeout ms (negative value waits forever), and returns either
-// kUTuiKeyNone (if the timeout elapsed), the key that was read, or
-// kUTuiInputError with UTuiInput.error set
+// kUTuiKeyNone (if the timeout elapsed), the key that was read, kUTuiResize,
+// or kUTuiInputError with UTuiInput.error set
 UTuiKey UTuiInput_ReadKey(struct UTuiInput *, int timeout);
 #endif
\ No newline at end of file
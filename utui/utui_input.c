@@ -5,29 +5,88 @@
 #include <poll.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+// the SIGWINCH handler writes to the second fd, and the first is polled along
+// with stdin so that a resize wakes up a read
+static int resize_pipe[2] = {-1, -1};
+
+static void OnResize(int sig) {
+  (void) sig;
+  int saved_errno = errno;
+  // if the pipe is full, a resize is already pending
+  ssize_t unused = write(resize_pipe[1], "", 1);
+  (void) unused;
+  errno = saved_errno;
+}
+
+static bool SetupResizePipe(void) {
+  if (pipe(resize_pipe) == -1)
+    return false;
+  for (size_t i = 0; i < 2; i++) {
+    int flags = fcntl(resize_pipe[i], F_GETFL);
+    if (flags == -1 || fcntl(resize_pipe[i], F_SETFL, flags | O_NONBLOCK) == -1)
+      return false;
+    fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_handler = OnResize;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(SIGWINCH, &sa, NULL) == 0;
+}
 
 struct UTuiInput UTuiInput_Init(void) {
+  if (resize_pipe[0] == -1 && !SetupResizePipe()) {
+    // carry on without noticing resizes
+    close(resize_pipe[0]);
+    close(resize_pipe[1]);
+    resize_pipe[0] = resize_pipe[1] = -1;
+  }
   return (struct UTuiInput){0};
 }
 
+// empties the resize pipe, noting whether there was anything in it
+static void DrainResizePipe(struct UTuiInput *i) {
+  char buf[64];
+  while (read(resize_pipe[0], buf, sizeof(buf)) > 0)
+    i->resized = true;
+}
+
 static void UpdateInputQueue(struct UTuiInput *i, int timeout) {
-  struct pollfd pfd = {STDIN_FILENO, POLLIN};
-  int ready = poll(&pfd, 1, timeout);
+  // poll ignores negative fds, so this is just stdin without a resize pipe
+  struct pollfd pfds[2] = {
+    {STDIN_FILENO, POLLIN},
+    {resize_pipe[0], POLLIN},
+  };
+  int ready = poll(pfds, 2, timeout);
 
   if (ready == -1) {
+    // a resize that lands during the poll interrupts it
+    if (errno == EINTR) {
+      DrainResizePipe(i);
+      return;
+    }
     i->error = kUTuiInputErrorPoll;
     return;
   }
 
-  if (ready > 0) {
-    if (pfd.revents & POLLIN) {
+  if (pfds[1].revents & POLLIN)
+    DrainResizePipe(i);
+
+  short revents = pfds[0].revents;
+  if (revents) {
+    if (revents & POLLIN) {
       ssize_t result = read(STDIN_FILENO, i->seq + i->seq_cnt, sizeof(i->seq) - i->seq_cnt);
       if (result == -1) {
         i->error = kUTuiInputErrorRead;
         return;
       }
       i->seq_cnt += result;
-    } else if (pfd.revents & POLLHUP) {
+    } else if (revents & POLLHUP) {
       i->error = kUTuiInputErrorHup;
     } else {
       i->error = kUTuiInputErrorPoll;
@@ -76,6 +135,10 @@ UTuiKey UTuiInput_ReadKey(struct UTuiInput *in, int timeout) {
   else
     UpdateInputQueue(in, 0);
   if (in->error) return kUTuiInputError;
+  if (in->resized) {
+    in->resized = false;
+    return kUTuiResize;
+  }
   if (in->seq_cnt == 0) return kUTuiKeyNone;
 
   // try to match a special key
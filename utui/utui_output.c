@@ -71,6 +71,8 @@ void UTuiOutput_Resize(struct UTuiOutput *o, size_t num_cols, size_t num_rows) {
   o->num_cols = num_cols;
   o->num_rows = num_rows;
   o->prev_row_hashes = xrecalloc(o->prev_row_hashes, num_rows * sizeof(*o->prev_row_hashes));
+  // the terminal may have reflowed or dropped what was on it
+  WriteBufNullStr(o, "\x1b[2J");
 }
 
 static size_t ColorEscapeStr(size_t n, char *s, struct UTuiColor *c) {